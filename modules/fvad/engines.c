@@ -0,0 +1,207 @@
+/**
+ * @file engines.c  Energy and spectral flatness VAD engines
+ *
+ * Both engines work on blocks of 10 ms and compare the block energy with
+ * an adaptive noise floor, which only rises on unvoiced blocks. The spectral
+ * flatness engine additionally requires a non-flat (tonal) spectrum, which
+ * rejects stationary noise that is louder than the floor.
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+#include <math.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "vad.h"
+
+
+enum {
+	BLOCK    = 80,     /* 10 ms @ 8 kHz                  */
+	BLOCK_MS = 10,
+	BINS     = 40,     /* 100 Hz .. 4 kHz                */
+	DOWN_MS  = 100,    /* Noise floor fall time constant */
+	UP_MS    = 10000,  /* Noise floor rise time constant */
+};
+
+#define ENERGY_MIN     1074.0  /**< -60 dBov mean square energy       */
+#define ENERGY_MARGIN  7.943   /**< Energy engine: +9 dB above floor  */
+#define SFLAT_MARGIN   1.995   /**< Flatness engine: +3 dB over floor */
+#define SFLAT_MIN_DB   5.0     /**< Minimum -SFM of a voiced block     */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+struct floor {
+	double e;
+	double down;   /* per-block fall rate */
+	double up;     /* per-block rise rate */
+	bool init;
+};
+
+
+static struct {
+	float hannv[BLOCK];
+	float cosv[BLOCK];
+	float sinv[BLOCK];
+	bool init;
+} tab;
+
+
+static double block_energy(const int16_t *sampv)
+{
+	int64_t energy = 0;
+
+	for (size_t i = 0; i < BLOCK; i++)
+		energy += (int32_t)sampv[i] * sampv[i];
+
+	return (double)energy / BLOCK;
+}
+
+
+/* follow the floor down fast, and up slowly on unvoiced blocks only */
+static void floor_update(struct floor *f, double e, bool voiced)
+{
+	if (!f->init) {
+		f->e    = e;
+		f->init = true;
+	}
+
+	if (e < f->e)
+		f->e += (e - f->e) * f->down;
+	else if (!voiced)
+		f->e += (e - f->e) * f->up;
+}
+
+
+static int floor_alloc(void **stp)
+{
+	struct floor *f = mem_zalloc(sizeof(*f), NULL);
+	if (!f)
+		return ENOMEM;
+
+	f->down = 1.0 - exp(-(double)BLOCK_MS / DOWN_MS);
+	f->up   = 1.0 - exp(-(double)BLOCK_MS / UP_MS);
+
+	*stp = f;
+	return 0;
+}
+
+
+static uint32_t energy_proc(void *st, const struct auframe *af)
+{
+	const int16_t *sampv = af->sampv;
+	const size_t blocks = af->sampc / BLOCK;
+	struct floor *f = st;
+	size_t voiced = 0;
+
+	for (size_t b = 0; b < blocks; b++) {
+		const double e = block_energy(&sampv[b * BLOCK]);
+		const bool v = e >= ENERGY_MIN && (!f->init ||
+						   e >= f->e * ENERGY_MARGIN);
+
+		voiced += v;
+		floor_update(f, e, v);
+	}
+
+	return blocks ? (uint32_t)(voiced * 100 / blocks) : 0;
+}
+
+
+/**
+ * Spectral flatness measure of a block
+ *
+ * @param sampv Block of BLOCK samples
+ *
+ * @return -10 log10(geometric mean / arithmetic mean) of the power
+ *         spectrum, 0 for white noise and larger for tonal signals
+ */
+static double block_sfm(const int16_t *sampv)
+{
+	float x[BLOCK];
+	double lsum = 0.0, asum = 0.0;
+
+	for (size_t n = 0; n < BLOCK; n++)
+		x[n] = sampv[n] * tab.hannv[n];
+
+	for (size_t k = 1; k <= BINS; k++) {
+		float re = 0.0f, im = 0.0f;
+		size_t idx = 0;
+
+		for (size_t n = 0; n < BLOCK; n++) {
+			re += x[n] * tab.cosv[idx];
+			im -= x[n] * tab.sinv[idx];
+
+			idx += k;
+			if (idx >= BLOCK)
+				idx -= BLOCK;
+		}
+
+		const double p = (double)re * re + (double)im * im + 1e-3;
+
+		asum += p;
+		lsum += log(p);
+	}
+
+	const double am = asum / BINS;
+	const double gm = exp(lsum / BINS);
+
+	return -10.0 * log10(gm / am);
+}
+
+
+static int sflat_alloc(void **stp)
+{
+	if (!tab.init) {
+		for (size_t n = 0; n < BLOCK; n++) {
+			const double w = 2.0 * M_PI * n / BLOCK;
+
+			tab.hannv[n] = (float)(0.5 - 0.5 * cos(w));
+			tab.cosv[n]  = (float)cos(w);
+			tab.sinv[n]  = (float)sin(w);
+		}
+
+		tab.init = true;
+	}
+
+	return floor_alloc(stp);
+}
+
+
+static uint32_t sflat_proc(void *st, const struct auframe *af)
+{
+	const int16_t *sampv = af->sampv;
+	const size_t blocks = af->sampc / BLOCK;
+	struct floor *f = st;
+	size_t voiced = 0;
+
+	for (size_t b = 0; b < blocks; b++) {
+		const int16_t *block = &sampv[b * BLOCK];
+		const double e = block_energy(block);
+		bool v = false;
+
+		/* the spectrum is only computed above the floor */
+		if (e >= ENERGY_MIN && (!f->init || e >= f->e * SFLAT_MARGIN))
+			v = block_sfm(block) >= SFLAT_MIN_DB;
+
+		voiced += v;
+		floor_update(f, e, v);
+	}
+
+	return blocks ? (uint32_t)(voiced * 100 / blocks) : 0;
+}
+
+
+const struct vad_engine vad_eng_energy = {
+	"energy",
+	floor_alloc,
+	energy_proc
+};
+
+
+const struct vad_engine vad_eng_sflat = {
+	"sflat",
+	sflat_alloc,
+	sflat_proc
+};
@@ -5,12 +5,17 @@
  *
  * Copyright (C) 2023 Lars Immisch
  */
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <stdlib.h>
 #include <re.h>
 #include <rem.h>
+#include <re_atomic.h>
 #include <baresip.h>
 #include <fvad.h>
+#include "vad.h"
 
 
 /**
@@ -18,23 +23,189 @@
  *
  * Voice Activity Detection for the audio-signal.
  *
- * It is using the aufilt API to get the audio samples.
+ * It is using the aufilt API to get the audio samples. S16LE and FLOAT
+ * frames with any number of channels and any sample rate from 8 kHz are
+ * accepted; they are downmixed to mono S16LE and decimated to 8 kHz into a
+ * preallocated buffer before detection.
+ *
+ * The detection runs in one of the engines "fvad" (libfvad), "energy"
+ * (adaptive energy threshold) or "sflat" (energy and spectral flatness).
+ * The engine is set with fvad_engine and can be overridden per account
+ * with the extra parameter vad_engine, e.g. ;extra=vad_engine=energy
+ *
+ * Every frame is processed completely and gives a voiced ratio. A frame is
+ * voiced if the ratio reaches fvad_ratio. The VAD state changes to "on"
+ * after fvad_attack ms of voiced frames and back to "off" after
+ * fvad_hangover ms of unvoiced frames.
+ *
+ * Configuration options:
+ *
+ \verbatim
+  fvad_engine    <name>    # fvad, energy or sflat (default fvad)
+  fvad_mode      0-3       # libfvad aggressiveness mode (default 0)
+  fvad_rx        yes|no    # Enable VAD on the decoder (default yes)
+  fvad_tx        yes|no    # Enable VAD on the encoder (default yes)
+  fvad_ratio     0-100     # Voiced ratio of a frame in [%] (default 50)
+  fvad_attack    <ms>      # Voiced time until "on" (default 20)
+  fvad_hangover  <ms>      # Unvoiced time until "off" (default 300)
+  fvad_pregate   yes|no    # Skip the engine on silence (default yes)
+  fvad_pregate_db <dB>     # Margin above the noise floor (default 6)
+  fvad_async     yes|no    # Run the VAD in a worker pool (default no)
+  fvad_workers   <n>       # Number of worker threads (default 2)
+  fvad_dtx       yes|no    # Suppress TX while "off" (default no)
+  fvad_dtx_cn    <ms>      # Comfort noise interval in DTX (default 400)
+  fvad_record    yes|no    # Record the voiced segments (default no)
+  fvad_record_path <dir>   # Directory of the segment files (default .)
+  fvad_record_preroll <ms> # Audio before a segment, max 500 (default 300)
+ \endverbatim
+ *
+ * The pre-gate compares the frame energy with an adaptive noise floor and
+ * skips the engine for frames that are close to the floor, or slightly above
+ * it with a noise-like zero-crossing rate. The floor only rises on skipped
+ * frames, so continuous speech does not raise it.
+ *
+ * In async mode the audio path only copies the frame into a ring, the
+ * detector runs in a shared worker pool and the events are emitted from
+ * the main thread.
+ *
+ * With DTX the encoder stream stops transmitting after the hangover of a
+ * talk spurt. Every fvad_dtx_cn ms one frame of comfort noise at the
+ * background level is let through.
+ *
+ * The command fvad_bench runs all engines over WAV files and reports the
+ * processing time per frame and the flap rate. If a label file
+ * <file>.wav.txt with the voiced regions exists, precision and recall are
+ * reported too.
+ * The command fvad_stats shows how many frames the pre-gate skipped.
+ *
+ * The recorder writes the voiced segments of each call and direction as
+ * mono 8 kHz WAV files <call-id>-<tx|rx>-<n>.wav. The detector hands the
+ * frames over in preallocated buffers; a background thread writes them.
+ *
+ * Talk time, silence time, talk spurts and double-talk are accounted per
+ * call. The command fvad_calls shows them for the active calls; they are
+ * logged and sent as "talk_stats" module event when the call is closed.
+ */
+
+
+enum {
+	BENCH_PTIME = 20,
+	MIX_PTIME   = 60,        /* Preallocated downmix buffer in [ms]  */
+	VAD_SRATE   = 8000,      /* libfvad sample rate                  */
+	SPURT_BINS  = 6,
+	CALL_HASH_SIZE = 256,
+	MAX_PREROLL = 500,
+	GATE_MIN_ENERGY = 1074,  /* -60 dBov mean square energy          */
+	GATE_ZCR_NOISE  = 40,    /* Noise-like zero-crossing rate in [%] */
+	GATE_DOWN_MS    = 100,   /* Noise floor fall time constant       */
+	GATE_UP_MS      = 10000, /* Noise floor rise time constant       */
+};
+
+
+enum vad_dir {
+	VAD_TX,
+	VAD_RX,
+	VAD_DIR_MAX
+};
+
+
+/** Energy pre-gate with adaptive noise floor */
+struct vad_gate {
+	double floor;    /* noise floor mean square energy */
+	bool init;
+};
+
+
+/** Attack/hangover smoothing of the per-frame decision */
+struct vad_smooth {
+	bool active;
+	uint32_t run;    /* time in the opposite state in [ms] */
+};
+
+
+/** Talk time of one direction of a call */
+struct vad_talk {
+	RE_ATOMIC uint64_t talk_ms;
+	RE_ATOMIC uint64_t silence_ms;
+	RE_ATOMIC uint32_t spurts;
+	RE_ATOMIC uint32_t histv[SPURT_BINS];  /* talk-spurt lengths */
+	uint32_t spurt_ms;        /* current spurt, detector thread only */
+};
+
+
+/**
+ * Per-call state, indexed by call and by audio object. Shared by the
+ * encoder and decoder of the call.
  */
+struct vad_call {
+	struct le le;
+	struct le he_call;
+	struct le he_audio;
+	struct call *call;
+	const struct audio *audio;
+	struct vad_talk talkv[VAD_DIR_MAX];
+	RE_ATOMIC bool activev[VAD_DIR_MAX];
+	RE_ATOMIC uint64_t double_ms;          /* both directions voiced */
+};
+
+
+/** Detector of one direction */
+struct vad_det {
+	const struct vad_engine *eng;
+	void *est;                /* engine state */
+	struct vad_gate gate;
+	struct vad_smooth smooth;
+	RE_ATOMIC bool active;    /* smooth.active for the audio thread */
+	enum vad_dir dir;
+	struct call *call;
+	struct vad_call *vc;
+	struct vad_rec *rec;
+};
+
+
+/** VAD state change, emitted from the main thread in async mode */
+struct vad_event {
+	struct vad_call *vc;      /* the call is NULL once it is closed */
+	enum vad_dir dir;
+	bool active;
+	uint32_t ratio;
+};
+
+
+/** Conversion of the input to mono S16LE at VAD_SRATE */
+struct vad_mix {
+	int16_t *sampv;
+	size_t sampc;             /* capacity in samples       */
+	uint32_t phase;           /* decimator phase           */
+	int32_t sum;              /* decimator partial sum     */
+	uint32_t cnt;             /* samples in the partial sum */
+};
+
+
+/** Discontinuous transmission of the encoder */
+struct vad_dtx {
+	struct stream *strm;
+	bool on;                  /* transmission suppressed     */
+	uint32_t elapsed;         /* since the last CN frame [ms] */
+	double level;             /* background level in [dBov]  */
+	uint32_t rng;
+};
 
 
 struct vad_enc {
 	struct aufilt_enc_st af;  /* inheritance */
-	bool vad_tx;
-	Fvad *fvad;
-	struct call *call;
+	struct vad_mix mix;
+	struct vad_dtx dtx;
+	struct vad_det *det;
+	struct vad_queue *queue;  /* async mode */
 };
 
 
 struct vad_dec {
-	struct aufilt_enc_st af;  /* inheritance */
-	bool vad_rx;
-	Fvad *fvad;
-	struct call *call;
+	struct aufilt_dec_st af;  /* inheritance */
+	struct vad_mix mix;
+	struct vad_det *det;
+	struct vad_queue *queue;  /* async mode */
 };
 
 struct filter_arg {
@@ -43,12 +214,166 @@ struct filter_arg {
 };
 
 
+static struct {
+	uint32_t ratio;
+	uint32_t attack;
+	uint32_t hangover;
+	bool pregate;
+	uint32_t pregate_db;
+	double margin;
+	bool async;
+	uint32_t workers;
+	bool dtx;
+	uint32_t dtx_cn;
+	const struct vad_engine *eng;
+	bool record;
+	uint32_t preroll;
+} vad_cfg = {
+	50,
+	20,
+	300,
+	true,
+	6,
+	1.0,
+	false,
+	2,
+	false,
+	400,
+	NULL,
+	false,
+	300,
+};
+
+
+static struct {
+	RE_ATOMIC uint64_t frames;
+	RE_ATOMIC uint64_t skipped;
+	RE_ATOMIC uint64_t dropped;
+	RE_ATOMIC uint64_t suppressed;
+	RE_ATOMIC uint64_t cn;
+} vad_stats[VAD_DIR_MAX];
+
+
+static struct mqueue *vad_mq;
+static struct list vad_calls;
+static struct hash *vad_callh;
+static struct hash *vad_audioh;
+
+static struct {
+	uint64_t usec;
+	uint32_t n;
+	uint32_t misses;
+} lookup_stats;
+
+/** Upper limits of the talk-spurt histogram bins in [ms] */
+static const uint32_t spurt_limv[SPURT_BINS - 1] = {
+	500, 1000, 2000, 5000, 10000
+};
+
+
+static void det_work_handler(const struct auframe *af, void *arg);
+static const struct vad_engine *engine_select(const struct call *call);
+
+
+static void det_destructor(void *arg)
+{
+	struct vad_det *det = arg;
+
+	vad_rec_close(det->rec);
+	mem_deref(det->est);
+	mem_deref(det->vc);
+}
+
+
+static uint32_t ptr_hash(const void *p)
+{
+	return hash_fast((const char *)&p, sizeof(p));
+}
+
+
+static bool call_cmp_handler(struct le *le, void *arg)
+{
+	const struct vad_call *vc = le->data;
+
+	return vc->call == arg;
+}
+
+
+static bool audio_cmp_handler(struct le *le, void *arg)
+{
+	const struct vad_call *vc = le->data;
+
+	return vc->audio == arg;
+}
+
+
+static struct vad_call *vad_call_find(const struct call *call)
+{
+	struct le *le;
+
+	le = hash_lookup(vad_callh, ptr_hash(call), call_cmp_handler,
+			 (void *)call);
+
+	return le ? le->data : NULL;
+}
+
+
+/**
+ * Get the state of a call, the module keeps it until the call is closed
+ *
+ * @param call Call
+ *
+ * @return Call state or NULL
+ */
+static struct vad_call *vad_call_get(struct call *call)
+{
+	struct vad_call *vc;
+
+	if (!call || !vad_callh)
+		return NULL;
+
+	vc = vad_call_find(call);
+	if (!vc) {
+		vc = mem_zalloc(sizeof(*vc), NULL);
+		if (!vc)
+			return NULL;
+
+		vc->call = call;
+		list_append(&vad_calls, &vc->le, vc);
+		hash_append(vad_callh, ptr_hash(call), &vc->he_call, vc);
+	}
+
+	if (!vc->audio) {
+		vc->audio = call_audio(call);
+		if (vc->audio)
+			hash_append(vad_audioh, ptr_hash(vc->audio),
+				    &vc->he_audio, vc);
+	}
+
+	return vc;
+}
+
+
+static void vad_call_remove(struct vad_call *vc)
+{
+	list_unlink(&vc->le);
+	hash_unlink(&vc->he_call);
+	hash_unlink(&vc->he_audio);
+	vc->call = NULL;
+	mem_deref(vc);
+}
+
+
 static void enc_destructor(void *arg)
 {
 	struct vad_enc *st = arg;
 
-	if (st->fvad)
-		fvad_free(st->fvad);
+	if (st->dtx.on)
+		stream_enable_tx(st->dtx.strm, true);
+
+	vad_queue_close(st->queue);
+	mem_deref(st->det);
+	mem_deref(st->mix.sampv);
 
 	list_unlink(&st->af.le);
 }
@@ -58,8 +383,9 @@ static void dec_destructor(void *arg)
 {
 	struct vad_dec *st = arg;
 
-	if (st->fvad)
-		fvad_free(st->fvad);
+	vad_queue_close(st->queue);
+	mem_deref(st->det);
+	mem_deref(st->mix.sampv);
 
 	list_unlink(&st->af.le);
 }
@@ -81,30 +407,72 @@ static bool find_call(const struct call *call, void *arg)
 	return call_audio(call) == fa->audio;
 }
 
+
+/**
+ * Find the call owning an audio object
+ *
+ * The index is filled from the UA events. Only an audio object that was
+ * not seen in an event yet falls back to scanning all calls.
+ *
+ * @param au Audio object
+ *
+ * @return Call state or NULL
+ */
+static struct vad_call *vad_call_by_audio(const struct audio *au)
+{
+	struct filter_arg fa = { au, NULL };
+	const uint64_t t = tmr_jiffies_usec();
+	struct le *le = NULL;
+	struct vad_call *vc;
+
+	if (vad_audioh)
+		le = hash_lookup(vad_audioh, ptr_hash(au), audio_cmp_handler,
+				 (void *)au);
+	if (le) {
+		vc = le->data;
+	}
+	else {
+		uag_filter_calls(find_first_call, find_call, &fa);
+		vc = vad_call_get(fa.call);
+		++lookup_stats.misses;
+	}
+
+	lookup_stats.usec += tmr_jiffies_usec() - t;
+	++lookup_stats.n;
+
+	return vc;
+}
+
 static int check_fvad_params(const struct aufilt_prm *prm)
 {
 	if (!prm)
 		return EINVAL;
 
-	if (prm->ch != 1) {
-		warning("fvad: only mono is supported\n");
+	if (!prm->ch) {
+		warning("fvad: invalid channel count\n");
+		return EINVAL;
+	}
+
+	if (prm->srate < VAD_SRATE) {
+		warning("fvad: sample rate %u is not supported\n",
+			prm->srate);
 		return EINVAL;
 	}
 
-	if (prm->fmt != AUFMT_S16LE) {
-		warning("fvad: only AUFMT_S16LE is supported. "
-			"Use the auconv module to fix this\n");
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT) {
+		warning("fvad: only AUFMT_S16LE and AUFMT_FLOAT are "
+			"supported. Use the auconv module to fix this\n");
 		return EINVAL;
 	}
 
 	return 0;
 }
 
-static int init_fvad(Fvad **fvad, const struct aufilt_prm *prm)
+static int init_fvad(Fvad **fvad)
 {
 	struct conf *conf = conf_cur();
 
-	if (!fvad || !prm)
+	if (!fvad)
 		return EINVAL;
 
 	*fvad = fvad_new();
@@ -112,10 +480,11 @@ static int init_fvad(Fvad **fvad, const struct aufilt_prm *prm)
 		return ENOMEM;
 	}
 
-	int err = fvad_set_sample_rate(*fvad, prm->srate);
+	/* the input is decimated, libfvad always runs at 8 kHz */
+	int err = fvad_set_sample_rate(*fvad, VAD_SRATE);
 	if (err < 0) {
 		warning("fvad: sample rate %d is not supported\n",
-			prm->srate);
+			VAD_SRATE);
 		return EINVAL;
 	}
 
@@ -131,6 +500,225 @@ static int init_fvad(Fvad **fvad, const struct aufilt_prm *prm)
 	return 0;
 }
 
+/**
+ * Preallocate the conversion buffer, unless the input is mono S16LE at
+ * VAD_SRATE already
+ *
+ * @param mix Scratch buffer
+ * @param prm Filter parameters
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mix_init(struct vad_mix *mix, const struct aufilt_prm *prm)
+{
+	if (prm->ch == 1 && prm->fmt == AUFMT_S16LE &&
+	    prm->srate == VAD_SRATE)
+		return 0;
+
+	mix->sampc = prm->srate * MIX_PTIME / 1000;
+	mix->sampv = mem_alloc(mix->sampc * sizeof(int16_t), NULL);
+
+	return mix->sampv ? 0 : ENOMEM;
+}
+
+
+/* plain loops without branches, these are vectorized by the compiler */
+static void downmix_s16(int16_t *dst, const int16_t *src, size_t n,
+			uint8_t ch)
+{
+	if (ch == 2) {
+		for (size_t i = 0; i < n; i++)
+			dst[i] = (int16_t)((src[2*i] + src[2*i + 1]) >> 1);
+
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		int32_t sum = 0;
+
+		for (uint8_t c = 0; c < ch; c++)
+			sum += src[i*ch + c];
+
+		dst[i] = (int16_t)(sum / ch);
+	}
+}
+
+
+static void downmix_float(int16_t *dst, const float *src, size_t n,
+			  uint8_t ch)
+{
+	const float scale = 32767.0f / ch;
+
+	for (size_t i = 0; i < n; i++) {
+		float sum = 0.0f;
+
+		for (uint8_t c = 0; c < ch; c++)
+			sum += src[i*ch + c];
+
+		sum *= scale;
+		sum = sum >  32767.0f ?  32767.0f : sum;
+		sum = sum < -32768.0f ? -32768.0f : sum;
+
+		dst[i] = (int16_t)sum;
+	}
+}
+
+
+/**
+ * Decimate to VAD_SRATE with a boxcar filter over each output period
+ *
+ * Works for any input rate and in place, the partial sum is carried over
+ * to the next frame.
+ *
+ * @param mix   Decimator state
+ * @param dst   Output samples
+ * @param src   Input samples
+ * @param n     Number of input samples
+ * @param srate Input sample rate
+ *
+ * @return Number of output samples
+ */
+static size_t decimate(struct vad_mix *mix, int16_t *dst,
+		       const int16_t *src, size_t n, uint32_t srate)
+{
+	size_t o = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		mix->sum += src[i];
+		++mix->cnt;
+
+		mix->phase += VAD_SRATE;
+		if (mix->phase < srate)
+			continue;
+
+		mix->phase -= srate;
+		dst[o++] = (int16_t)(mix->sum / (int32_t)mix->cnt);
+		mix->sum = 0;
+		mix->cnt = 0;
+	}
+
+	return o;
+}
+
+
+/**
+ * Get a mono S16LE view of an audio frame at VAD_SRATE
+ *
+ * @param mix Conversion state
+ * @param out Frame for the converted samples
+ * @param af  Input frame
+ *
+ * @return af itself if no conversion is needed, out after conversion or
+ *         NULL
+ */
+static const struct auframe *mix_frame(struct vad_mix *mix,
+				       struct auframe *out,
+				       const struct auframe *af)
+{
+	const bool mono = af->ch == 1 && af->fmt == AUFMT_S16LE;
+
+	if (mono && af->srate == VAD_SRATE)
+		return af;
+
+	if (!af->ch || af->srate < VAD_SRATE)
+		return NULL;
+
+	const size_t n = af->sampc / af->ch;
+
+	/* only if the ptime grows beyond MIX_PTIME */
+	if (n > mix->sampc) {
+		int16_t *sampv = mem_realloc(mix->sampv, n * sizeof(*sampv));
+		if (!sampv)
+			return NULL;
+
+		mix->sampv = sampv;
+		mix->sampc = n;
+	}
+
+	const int16_t *src = mix->sampv;
+	size_t m = n;
+
+	if (mono)
+		src = af->sampv;
+	else if (af->fmt == AUFMT_S16LE)
+		downmix_s16(mix->sampv, af->sampv, n, af->ch);
+	else if (af->fmt == AUFMT_FLOAT)
+		downmix_float(mix->sampv, af->sampv, n, af->ch);
+	else
+		return NULL;
+
+	if (af->srate != VAD_SRATE)
+		m = decimate(mix, mix->sampv, src, n, af->srate);
+
+	auframe_init(out, AUFMT_S16LE, mix->sampv, m, VAD_SRATE, 1);
+	out->timestamp = af->timestamp;
+
+	return out;
+}
+
+
+/**
+ * Allocate the detector of a filter state
+ *
+ * In async mode the detector is shared with a worker pool queue.
+ *
+ * @param detp   Pointer to detector
+ * @param queuep Pointer to queue (async mode)
+ * @param au     Audio object
+ * @param dir    Direction
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int det_setup(struct vad_det **detp, struct vad_queue **queuep,
+		     const struct audio *au, enum vad_dir dir)
+{
+	struct vad_det *det;
+
+	det = mem_zalloc(sizeof(*det), det_destructor);
+	if (!det)
+		return ENOMEM;
+
+	det->vc  = mem_ref(vad_call_by_audio(au));
+	det->dir = dir;
+	if (det->vc)
+		det->call = det->vc->call;
+
+	det->eng = engine_select(det->call);
+
+	int err = det->eng->alloch(&det->est);
+	if (err)
+		goto out;
+
+	if (vad_cfg.record) {
+		char name[256];
+
+		re_snprintf(name, sizeof(name), "%s-%s",
+			    det->call ? call_id(det->call) : "nocall",
+			    dir == VAD_TX ? "tx" : "rx");
+
+		/* the call goes on without recording */
+		if (vad_rec_alloc(&det->rec, name, vad_cfg.preroll))
+			warning("fvad: recorder for %s failed\n", name);
+	}
+
+	if (vad_cfg.async) {
+		err = vad_queue_alloc(queuep, det_work_handler, det);
+		if (err)
+			goto out;
+
+		mem_ref(det);
+	}
+
+ out:
+	if (err)
+		mem_deref(det);
+	else
+		*detp = det;
+
+	return err;
+}
+
+
 static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 			 const struct aufilt *af, struct aufilt_prm *prm,
 			 const struct audio *au)
@@ -152,19 +740,17 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
-	err = init_fvad(&st->fvad, prm);
+	st->dtx.strm  = audio_strm(au);
+	st->dtx.level = -96.0;
+	st->dtx.rng   = rand_u32();
+
+	err  = mix_init(&st->mix, prm);
+	err |= det_setup(&st->det, &st->queue, au, VAD_TX);
 	if (err) {
 		mem_deref(st);
 		return err;
 	}
 
-	if (!st->call) {
-		struct filter_arg fa = { au, NULL };
-
-		uag_filter_calls(find_first_call, find_call, &fa);
-		st->call = fa.call;
-	}
-
 	*stp = (struct aufilt_enc_st *)st;
 	return 0;
 }
@@ -191,25 +777,27 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
-	err = init_fvad(&st->fvad, prm);
+	err  = mix_init(&st->mix, prm);
+	err |= det_setup(&st->det, &st->queue, au, VAD_RX);
 	if (err) {
 		mem_deref(st);
 		return err;
 	}
 
-	if (!st->call) {
-		struct filter_arg fa = { au, NULL };
-
-		uag_filter_calls(find_first_call, find_call, &fa);
-		st->call = fa.call;
-	}
-
 	*stp = (struct aufilt_dec_st *)st;
 	return 0;
 }
 
 
-static bool auframe_vad(Fvad *fvad, struct auframe *af)
+/**
+ * Run libfvad over the whole audio frame
+ *
+ * @param fvad libfvad instance
+ * @param af   Audio frame
+ *
+ * @return Voiced ratio of the frame in [%]
+ */
+static uint32_t auframe_vad(Fvad *fvad, const struct auframe *af)
 {
 	static int chunk_times_ms[] = { 30, 20, 10 };
 
@@ -217,10 +805,11 @@ static bool auframe_vad(Fvad *fvad, struct auframe *af)
 		warning("fvad: invalid sample format %d\n",
 			af->fmt);
 
-		return false;
+		return 0;
 	}
 
 	size_t pos = 0;
+	size_t voiced = 0;
 
 	/* process all chunk_sizes that fvad accepts */
 	for (size_t chunk_time_index = 0;
@@ -234,15 +823,16 @@ static bool auframe_vad(Fvad *fvad, struct auframe *af)
 
 			int err = fvad_process(fvad, (int16_t*)af->sampv + pos,
 					       sampc);
-			pos += sampc;
-			if (err > 0) {
-				return true;
-			}
-			else if (err < 0) {
+			if (err < 0) {
 				warning("fvad: fvad_process(%d) failed\n",
 					sampc);
-				return false;
+				return 0;
 			}
+
+			if (err > 0)
+				voiced += sampc;
+
+			pos += sampc;
 		}
 	}
 
@@ -251,49 +841,484 @@ static bool auframe_vad(Fvad *fvad, struct auframe *af)
 			af->sampc - pos);
 	}
 
-	return false;
+	return pos ? (uint32_t)(voiced * 100 / pos) : 0;
 }
 
 
-static int encode(struct aufilt_enc_st *st, struct auframe *af)
+/**
+ * Energy and zero-crossing pre-gate
+ *
+ * @param g  Gate state
+ * @param af Audio frame (S16LE)
+ *
+ * @return true if the frame is silence and libfvad can be skipped
+ */
+static bool pregate_silent(struct vad_gate *g, const struct auframe *af)
 {
-	struct vad_enc *vad = (void *)st;
-
-	if (!st || !af)
-		return EINVAL;
+	const int16_t *sampv = af->sampv;
+	const size_t sampc = af->sampc;
+	int64_t energy = 0;
+	size_t zc = 0;
+
+	if (!sampc)
+		return true;
+
+	/* separate loops, both are vectorized by the compiler */
+	for (size_t i = 0; i < sampc; i++)
+		energy += (int32_t)sampv[i] * sampv[i];
+
+	for (size_t i = 1; i < sampc; i++)
+		zc += (sampv[i - 1] ^ sampv[i]) < 0;
+
+	const double e = (double)energy / (double)sampc;
+	const uint32_t zcr = (uint32_t)(zc * 100 / sampc);
+	const double ms = (double)sampc * 1000.0 /
+		((af->srate ? af->srate : VAD_SRATE) * (af->ch ? af->ch : 1));
+	bool silent;
+
+	if (!g->init) {
+		g->floor = e;
+		g->init  = true;
+	}
 
-	bool vad_tx = auframe_vad(vad->fvad, af);
+	const double thres = g->floor * vad_cfg.margin;
 
-	if (vad_tx != vad->vad_tx) {
-		const char* desc = vad_tx ? "on" : "off";
-		vad->vad_tx = vad_tx;
+	if (e < GATE_MIN_ENERGY || e < thres)
+		silent = true;
+	else
+		silent = zcr >= GATE_ZCR_NOISE && e < thres * vad_cfg.margin;
 
-		debug("vfad: vad_tx: %s\n", desc);
-		module_event("fvad", "vad_tx", call_get_ua(vad->call),
-			     vad->call, desc);
-	}
+	/* follow the floor down fast, and up slowly on silence only */
+	if (e < g->floor)
+		g->floor += (e - g->floor) * (1.0 - exp(-ms / GATE_DOWN_MS));
+	else if (silent)
+		g->floor += (e - g->floor) * (1.0 - exp(-ms / GATE_UP_MS));
 
-	return 0;
+	return silent;
 }
 
 
-static int decode(struct aufilt_dec_st *st, struct auframe *af)
-{
-	struct vad_dec *vad = (void *)st;
+struct libfvad_st {
+	Fvad *fvad;
+};
+
+
+static void libfvad_destructor(void *arg)
+{
+	struct libfvad_st *st = arg;
+
+	if (st->fvad)
+		fvad_free(st->fvad);
+}
+
+
+static int libfvad_alloc(void **stp)
+{
+	struct libfvad_st *st;
+
+	st = mem_zalloc(sizeof(*st), libfvad_destructor);
+	if (!st)
+		return ENOMEM;
+
+	int err = init_fvad(&st->fvad);
+	if (err) {
+		mem_deref(st);
+		return err;
+	}
+
+	*stp = st;
+	return 0;
+}
+
+
+static uint32_t libfvad_proc(void *st, const struct auframe *af)
+{
+	struct libfvad_st *lst = st;
+
+	return auframe_vad(lst->fvad, af);
+}
+
+
+static const struct vad_engine vad_eng_fvad = {
+	"fvad",
+	libfvad_alloc,
+	libfvad_proc
+};
+
+
+static const struct vad_engine *enginev[] = {
+	&vad_eng_fvad,
+	&vad_eng_energy,
+	&vad_eng_sflat,
+};
+
+
+static const struct vad_engine *engine_find(const struct pl *name)
+{
+	for (size_t i = 0; i < RE_ARRAY_SIZE(enginev); i++) {
+		if (!pl_strcasecmp(name, enginev[i]->name))
+			return enginev[i];
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Select the engine of a call, "vad_engine" in the account's extra
+ * parameters overrides fvad_engine
+ *
+ * @param call Call (optional)
+ *
+ * @return VAD engine
+ */
+static const struct vad_engine *engine_select(const struct call *call)
+{
+	const struct vad_engine *eng = NULL;
+	const char *extra = NULL;
+	struct pl pl, val;
+
+	if (call)
+		extra = account_extra(call_account(call));
+
+	if (str_isset(extra)) {
+		pl_set_str(&pl, extra);
+		if (fmt_param_sep_get(&pl, "vad_engine", ',', &val)) {
+			eng = engine_find(&val);
+			if (!eng)
+				warning("fvad: unknown engine '%r'\n", &val);
+		}
+	}
+
+	return eng ? eng : vad_cfg.eng;
+}
+
+
+/**
+ * Get the voiced ratio of a frame, skipping the engine on obvious silence
+ *
+ * @param eng  VAD engine
+ * @param est  Engine state
+ * @param g    Gate state
+ * @param af   Audio frame
+ * @param dir  Direction for the statistics
+ *
+ * @return Voiced ratio of the frame in [%]
+ */
+static uint32_t frame_vad(const struct vad_engine *eng, void *est,
+			  struct vad_gate *g, const struct auframe *af,
+			  enum vad_dir dir)
+{
+	re_atomic_rlx_add(&vad_stats[dir].frames, 1);
+
+	if (vad_cfg.pregate && af->fmt == AUFMT_S16LE &&
+	    pregate_silent(g, af)) {
+		re_atomic_rlx_add(&vad_stats[dir].skipped, 1);
+		return 0;
+	}
+
+	return eng->proch(est, af);
+}
+
+
+/**
+ * Apply attack and hangover to the per-frame decision
+ *
+ * @param vs    Smoothing state
+ * @param ratio Voiced ratio of the frame in [%]
+ * @param ms    Frame duration in [ms]
+ *
+ * @return true if the smoothed state changed
+ */
+static bool vad_smooth_update(struct vad_smooth *vs, uint32_t ratio,
+			      uint32_t ms)
+{
+	bool voiced = ratio && ratio >= vad_cfg.ratio;
+
+	if (voiced == vs->active) {
+		vs->run = 0;
+		return false;
+	}
+
+	vs->run += ms;
+	if (vs->run < (voiced ? vad_cfg.attack : vad_cfg.hangover))
+		return false;
+
+	vs->active = voiced;
+	vs->run = 0;
+	return true;
+}
+
+
+static uint32_t auframe_ms(const struct auframe *af)
+{
+	if (!af->srate || !af->ch)
+		return 0;
+
+	return (uint32_t)(af->sampc * 1000 / (af->srate * af->ch));
+}
+
+
+static void vad_report(struct call *call, enum vad_dir dir, bool active,
+		       uint32_t ratio)
+{
+	static const char *eventv[VAD_DIR_MAX] = {"vad_tx", "vad_rx"};
+	const char* desc = active ? "on" : "off";
+
+	debug("vfad: %s: %s (ratio %u%%)\n", eventv[dir], desc, ratio);
+	module_event("fvad", eventv[dir], call_get_ua(call), call, desc);
+}
+
+
+/**
+ * Account the talk time of a frame
+ *
+ * @param det     Detector
+ * @param ms      Frame duration in [ms]
+ * @param changed True if the VAD state changed with this frame
+ */
+static void talk_update(struct vad_det *det, uint32_t ms, bool changed)
+{
+	struct vad_call *vc = det->vc;
+
+	if (!vc)
+		return;
+
+	struct vad_talk *t = &vc->talkv[det->dir];
+
+	if (changed) {
+		re_atomic_rls_set(&vc->activev[det->dir], det->smooth.active);
+
+		if (det->smooth.active) {
+			re_atomic_rlx_add(&t->spurts, 1);
+		}
+		else {
+			size_t bin = 0;
+
+			while (bin < RE_ARRAY_SIZE(spurt_limv) &&
+			       t->spurt_ms >= spurt_limv[bin])
+				++bin;
+
+			re_atomic_rlx_add(&t->histv[bin], 1);
+			t->spurt_ms = 0;
+		}
+	}
+
+	if (det->smooth.active) {
+		re_atomic_rlx_add(&t->talk_ms, ms);
+		t->spurt_ms += ms;
+	}
+	else {
+		re_atomic_rlx_add(&t->silence_ms, ms);
+	}
+
+	/* double-talk is accounted by the encoder only */
+	if (det->dir == VAD_TX && det->smooth.active &&
+	    re_atomic_acq(&vc->activev[VAD_RX]))
+		re_atomic_rlx_add(&vc->double_ms, ms);
+}
+
+
+/**
+ * Run the detector over a frame
+ *
+ * @param det   Detector
+ * @param af    Audio frame
+ * @param ratio Returns the voiced ratio in [%]
+ *
+ * @return true if the smoothed VAD state changed
+ */
+static bool det_process(struct vad_det *det, const struct auframe *af,
+			uint32_t *ratio)
+{
+	const uint32_t ms = auframe_ms(af);
+
+	*ratio = frame_vad(det->eng, det->est, &det->gate, af, det->dir);
+
+	bool changed = vad_smooth_update(&det->smooth, *ratio, ms);
+	if (changed)
+		re_atomic_rls_set(&det->active, det->smooth.active);
+
+	talk_update(det, ms, changed);
+
+	if (det->rec)
+		vad_rec_frame(det->rec, af, det->smooth.active);
+
+	return changed;
+}
+
+
+static void event_destructor(void *arg)
+{
+	struct vad_event *ev = arg;
+
+	mem_deref(ev->vc);
+}
+
+
+/**
+ * Worker pool handler, runs the detector outside of the audio path
+ *
+ * @param af  Audio frame (copy)
+ * @param arg Detector
+ */
+static void det_work_handler(const struct auframe *af, void *arg)
+{
+	struct vad_det *det = arg;
+	struct vad_event *ev;
+	uint32_t ratio;
+
+	/* the events of a detector without a call are not reported */
+	if (!det_process(det, af, &ratio) || !det->vc)
+		return;
+
+	ev = mem_zalloc(sizeof(*ev), event_destructor);
+	if (!ev)
+		return;
+
+	ev->vc     = mem_ref(det->vc);
+	ev->dir    = det->dir;
+	ev->active = det->smooth.active;
+	ev->ratio  = ratio;
+
+	if (mqueue_push(vad_mq, 0, ev))
+		mem_deref(ev);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct vad_event *ev = data;
+	(void)id;
+	(void)arg;
+
+	/* the call may be gone while the frame was in the worker pool */
+	if (ev->vc->call)
+		vad_report(ev->vc->call, ev->dir, ev->active, ev->ratio);
+
+	mem_deref(ev);
+}
+
+
+static void frame_process(struct vad_det *det, struct vad_queue *queue,
+			  struct vad_mix *mix, const struct auframe *af,
+			  enum vad_dir dir)
+{
+	struct auframe mono;
+	uint32_t ratio;
+
+	af = mix_frame(mix, &mono, af);
+	if (!af)
+		return;
+
+	if (queue) {
+		if (!vad_queue_push(queue, af))
+			re_atomic_rlx_add(&vad_stats[dir].dropped, 1);
+
+		return;
+	}
+
+	if (det_process(det, af, &ratio))
+		vad_report(det->call, dir, det->smooth.active, ratio);
+}
+
+
+/**
+ * Replace the frame with white noise at the background level
+ *
+ * @param dtx DTX state
+ * @param af  Audio frame (S16LE or FLOAT)
+ */
+static void comfort_noise(struct vad_dtx *dtx, struct auframe *af)
+{
+	/* uniform noise with the RMS of the background level */
+	const double amp = 32767.0 * pow(10.0, dtx->level / 20.0) * sqrt(3.0);
+	const int32_t a = (int32_t)amp;
+
+	for (size_t i = 0; i < af->sampc; i++) {
+		int32_t v;
+
+		dtx->rng = dtx->rng * 1664525u + 1013904223u;
+		v = a ? (int32_t)(dtx->rng >> 16) % (2 * a + 1) - a : 0;
+
+		if (af->fmt == AUFMT_FLOAT)
+			((float *)af->sampv)[i] = (float)v / 32768.0f;
+		else
+			((int16_t *)af->sampv)[i] = (int16_t)v;
+	}
+}
+
+
+/**
+ * Suppress transmission while the TX VAD state is "off"
+ *
+ * The hangover of the VAD state keeps the transmission on after the end of
+ * a talk spurt. While suppressed, a comfort noise frame is sent every
+ * fvad_dtx_cn ms to keep the media path and the far end's playout alive.
+ *
+ * @param dtx    DTX state
+ * @param active TX VAD state
+ * @param af     Audio frame
+ */
+static void dtx_process(struct vad_dtx *dtx, bool active, struct auframe *af)
+{
+	if (active) {
+		if (dtx->on) {
+			stream_enable_tx(dtx->strm, true);
+			dtx->on = false;
+		}
+
+		return;
+	}
+
+	/* the level of a suppressed frame is the background level */
+	dtx->level = auframe_level(af);
+	dtx->elapsed += auframe_ms(af);
+
+	if (dtx->on && dtx->elapsed < vad_cfg.dtx_cn) {
+		re_atomic_rlx_add(&vad_stats[VAD_TX].suppressed, 1);
+		return;
+	}
+
+	if (dtx->on) {
+		stream_enable_tx(dtx->strm, true);
+		comfort_noise(dtx, af);
+		dtx->on = false;
+		dtx->elapsed = 0;
+		re_atomic_rlx_add(&vad_stats[VAD_TX].cn, 1);
+		return;
+	}
+
+	stream_enable_tx(dtx->strm, false);
+	dtx->on = true;
+	re_atomic_rlx_add(&vad_stats[VAD_TX].suppressed, 1);
+}
+
+
+static int encode(struct aufilt_enc_st *st, struct auframe *af)
+{
+	struct vad_enc *vad = (void *)st;
 
 	if (!st || !af)
 		return EINVAL;
 
-	bool vad_rx = auframe_vad(vad->fvad, af);
+	frame_process(vad->det, vad->queue, &vad->mix, af, VAD_TX);
 
-	if (vad_rx != vad->vad_rx) {
-		const char* desc = vad_rx ? "on" : "off";
-		vad->vad_rx = vad_rx;
+	if (vad_cfg.dtx)
+		dtx_process(&vad->dtx, re_atomic_acq(&vad->det->active), af);
 
-		debug("vfad: vad_rx: %s\n", desc);
-		module_event("fvad", "vad_rx", call_get_ua(vad->call),
-			     vad->call, desc);
-	}
+	return 0;
+}
+
+
+static int decode(struct aufilt_dec_st *st, struct auframe *af)
+{
+	struct vad_dec *vad = (void *)st;
+
+	if (!st || !af)
+		return EINVAL;
+
+	frame_process(vad->det, vad->queue, &vad->mix, af, VAD_RX);
 
 	return 0;
 }
@@ -308,10 +1333,406 @@ static struct aufilt vad = {
 };
 
 
+/** Voiced region of a labelled WAV file in [ms] */
+struct bench_label {
+	uint32_t start;
+	uint32_t end;
+};
+
+
+/**
+ * Load the labels of a WAV file
+ *
+ * The label file is <file>.wav.txt with one voiced region per line, start
+ * and end in seconds and an optional name (Audacity label track export).
+ *
+ * @param labvp Returns the label array
+ * @param labcp Returns the number of labels
+ * @param file  WAV file
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int bench_labels(struct bench_label **labvp, size_t *labcp,
+			const char *file)
+{
+	struct bench_label *labv = NULL;
+	size_t labc = 0;
+	char path[256];
+	double start, end;
+	FILE *f;
+
+	if (re_snprintf(path, sizeof(path), "%s.txt", file) < 0)
+		return ENAMETOOLONG;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while (fscanf(f, "%lf %lf%*[^\n]", &start, &end) == 2) {
+		struct bench_label *v;
+
+		v = mem_realloc(labv, (labc + 1) * sizeof(*labv));
+		if (!v) {
+			(void)fclose(f);
+			mem_deref(labv);
+			return ENOMEM;
+		}
+
+		labv = v;
+		labv[labc].start = (uint32_t)(start * 1000);
+		labv[labc].end   = (uint32_t)(end * 1000);
+		++labc;
+	}
+
+	(void)fclose(f);
+
+	*labvp = labv;
+	*labcp = labc;
+
+	return 0;
+}
+
+
+static bool bench_voiced(const struct bench_label *labv, size_t labc,
+			 uint32_t ms)
+{
+	for (size_t i = 0; i < labc; i++) {
+		if (ms >= labv[i].start && ms < labv[i].end)
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Run an engine over a WAV file
+ *
+ * @param pf   Print handler
+ * @param file WAV file
+ * @param eng  VAD engine
+ * @param labv Voiced regions (optional)
+ * @param labc Number of voiced regions
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int bench_file(struct re_printf *pf, const char *file,
+		      const struct vad_engine *eng,
+		      const struct bench_label *labv, size_t labc)
+{
+	struct aufile_prm fprm;
+	struct aufile *aufile = NULL;
+	struct aufilt_prm prm;
+	struct vad_smooth vs = { false, 0 };
+	struct vad_gate gate = { 0.0, false };
+	struct vad_mix mix = { NULL, 0, 0, 0, 0 };
+	void *est = NULL;
+	uint8_t *sampv = NULL;
+	uint64_t usec = 0;
+	uint32_t frames = 0, voiced = 0, flaps_raw = 0, flaps = 0;
+	uint32_t skipped = 0, tp = 0, fp = 0, fn = 0;
+	bool raw = false;
+
+	int err = aufile_open(&aufile, &fprm, file, AUFILE_READ);
+	if (err) {
+		re_hprintf(pf, "fvad_bench: %s: open failed (%m)\n",
+			   file, err);
+		return err;
+	}
+
+	prm.srate = fprm.srate;
+	prm.ch    = fprm.channels;
+	prm.fmt   = fprm.fmt;
+	err  = check_fvad_params(&prm);
+	err |= eng->alloch(&est);
+	err |= mix_init(&mix, &prm);
+	if (err)
+		goto out;
+
+	const size_t sampc = fprm.srate * fprm.channels * BENCH_PTIME / 1000;
+	const size_t fsz = sampc * aufmt_sample_size(fprm.fmt);
+	sampv = mem_alloc(fsz, NULL);
+	if (!sampv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		struct auframe af, mono;
+		const struct auframe *m;
+		size_t sz = fsz;
+
+		err = aufile_read(aufile, sampv, &sz);
+		if (err || sz < fsz)
+			break;
+
+		auframe_init(&af, fprm.fmt, sampv, sampc, fprm.srate,
+			     fprm.channels);
+
+		uint64_t t = tmr_jiffies_usec();
+		m = mix_frame(&mix, &mono, &af);
+		if (!m)
+			break;
+
+		bool silent = vad_cfg.pregate && pregate_silent(&gate, m);
+		uint32_t ratio = silent ? 0 : eng->proch(est, m);
+		bool changed = vad_smooth_update(&vs, ratio, BENCH_PTIME);
+		usec += tmr_jiffies_usec() - t;
+
+		bool v = ratio && ratio >= vad_cfg.ratio;
+		if (v != raw)
+			++flaps_raw;
+
+		if (labv) {
+			bool lv = bench_voiced(labv, labc, frames * BENCH_PTIME
+					       + BENCH_PTIME / 2);
+
+			tp += vs.active && lv;
+			fp += vs.active && !lv;
+			fn += !vs.active && lv;
+		}
+
+		raw = v;
+		voiced += vs.active;
+		flaps  += changed;
+		skipped += silent;
+		++frames;
+	}
+
+	if (!frames) {
+		re_hprintf(pf, "fvad_bench: %s: no audio\n", file);
+		goto out;
+	}
+
+	const uint64_t ms = (uint64_t)frames * BENCH_PTIME;
+	re_hprintf(pf, "%s %-6s: %u frames, %llu ns/frame, voiced %u%%, "
+		   "skipped %u%%, flaps/min raw %llu smoothed %llu", file,
+		   eng->name, frames, usec * 1000 / frames,
+		   voiced * 100 / frames, skipped * 100 / frames,
+		   (uint64_t)flaps_raw * 60000 / ms,
+		   (uint64_t)flaps * 60000 / ms);
+
+	if (labv) {
+		re_hprintf(pf, ", precision %u%% recall %u%%",
+			   tp + fp ? tp * 100 / (tp + fp) : 0,
+			   tp + fn ? tp * 100 / (tp + fn) : 0);
+	}
+
+	re_hprintf(pf, "\n");
+
+ out:
+	mem_deref(est);
+	mem_deref(sampv);
+	mem_deref(mix.sampv);
+	mem_deref(aufile);
+
+	return err;
+}
+
+
+static int cmd_bench(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl file, rest;
+	int err = 0;
+
+	pl_set_str(&rest, carg->prm);
+	while (!re_regex(rest.p, rest.l, "[^ ]+[ ]*", &file, NULL)) {
+		struct bench_label *labv = NULL;
+		size_t labc = 0;
+		char *path;
+
+		rest.l -= file.p + file.l - rest.p;
+		rest.p  = file.p + file.l;
+
+		if (pl_strdup(&path, &file))
+			return ENOMEM;
+
+		/* without labels only cost and flap rate are reported */
+		(void)bench_labels(&labv, &labc, path);
+
+		for (size_t i = 0; i < RE_ARRAY_SIZE(enginev); i++)
+			err |= bench_file(pf, path, enginev[i], labv, labc);
+
+		mem_deref(labv);
+		mem_deref(path);
+	}
+
+	if (!str_isset(carg->prm))
+		re_hprintf(pf, "usage: /fvad_bench <file.wav> ...\n");
+
+	return err;
+}
+
+
+static int cmd_stats(struct re_printf *pf, void *arg)
+{
+	static const char *dirv[VAD_DIR_MAX] = {"tx", "rx"};
+	int err = 0;
+	(void)arg;
+
+	err |= re_hprintf(pf, "fvad pre-gate %s margin=%udB\n",
+			  vad_cfg.pregate ? "on" : "off",
+			  vad_cfg.pregate_db);
+
+	if (vad_cfg.async)
+		err |= re_hprintf(pf, "fvad async workers=%u\n",
+				  vad_cfg.workers);
+
+	if (lookup_stats.n)
+		err |= re_hprintf(pf, "fvad call lookup n=%u avg=%lluus "
+				  "misses=%u\n", lookup_stats.n,
+				  lookup_stats.usec / lookup_stats.n,
+				  lookup_stats.misses);
+
+	err |= vad_rec_print(pf);
+
+	if (vad_cfg.dtx)
+		err |= re_hprintf(pf, "fvad dtx suppressed=%llu cn=%llu\n",
+			re_atomic_rlx(&vad_stats[VAD_TX].suppressed),
+			re_atomic_rlx(&vad_stats[VAD_TX].cn));
+
+	for (int i = 0; i < VAD_DIR_MAX; i++) {
+		uint64_t frames  = re_atomic_rlx(&vad_stats[i].frames);
+		uint64_t skipped = re_atomic_rlx(&vad_stats[i].skipped);
+
+		err |= re_hprintf(pf, "  %s: frames=%llu skipped=%llu "
+				  "(%llu%%) dropped=%llu\n", dirv[i], frames,
+				  skipped, frames ? skipped * 100 / frames : 0,
+				  re_atomic_rlx(&vad_stats[i].dropped));
+	}
+
+	return err;
+}
+
+
+static int talk_print(struct re_printf *pf, const struct vad_call *vc)
+{
+	static const char *dirv[VAD_DIR_MAX] = {"tx", "rx"};
+	int err;
+
+	err = re_hprintf(pf, "%s (%s): double-talk %.1fs\n",
+			 call_id(vc->call), call_peeruri(vc->call),
+			 re_atomic_rlx(&vc->double_ms) / 1000.0);
+
+	for (int i = 0; i < VAD_DIR_MAX; i++) {
+		const struct vad_talk *t = &vc->talkv[i];
+
+		err |= re_hprintf(pf, "  %s: talk %.1fs silence %.1fs "
+				  "spurts %u [", dirv[i],
+				  re_atomic_rlx(&t->talk_ms) / 1000.0,
+				  re_atomic_rlx(&t->silence_ms) / 1000.0,
+				  re_atomic_rlx(&t->spurts));
+
+		for (size_t b = 0; b < SPURT_BINS; b++)
+			err |= re_hprintf(pf, "%s%u", b ? " " : "",
+					  re_atomic_rlx(&t->histv[b]));
+
+		err |= re_hprintf(pf, "]\n");
+	}
+
+	return err;
+}
+
+
+static int cmd_calls(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err;
+	(void)arg;
+
+	err = re_hprintf(pf, "fvad talk time of %u calls, spurt histogram "
+			 "<0.5s <1s <2s <5s <10s >=10s\n",
+			 list_count(&vad_calls));
+
+	for (le = list_head(&vad_calls); le; le = le->next)
+		err |= talk_print(pf, le->data);
+
+	return err;
+}
+
+
+static void ua_event_handler(struct ua *ua, enum ua_event ev,
+			     struct call *call, const char *prm, void *arg)
+{
+	struct vad_call *vc;
+	(void)prm;
+	(void)arg;
+
+	if (!call)
+		return;
+
+	/* index the call before its audio filters are set up */
+	if (ev != UA_EVENT_CALL_CLOSED) {
+		(void)vad_call_get(call);
+		return;
+	}
+
+	vc = vad_call_find(call);
+	if (!vc)
+		return;
+
+	const struct vad_talk *tx = &vc->talkv[VAD_TX];
+	const struct vad_talk *rx = &vc->talkv[VAD_RX];
+
+	info("fvad: call closed: %H", talk_print, vc);
+	module_event("fvad", "talk_stats", ua, call,
+		     "tx_talk=%llu tx_silence=%llu tx_spurts=%u "
+		     "rx_talk=%llu rx_silence=%llu rx_spurts=%u "
+		     "double_talk=%llu",
+		     re_atomic_rlx(&tx->talk_ms),
+		     re_atomic_rlx(&tx->silence_ms),
+		     re_atomic_rlx(&tx->spurts),
+		     re_atomic_rlx(&rx->talk_ms),
+		     re_atomic_rlx(&rx->silence_ms),
+		     re_atomic_rlx(&rx->spurts),
+		     re_atomic_rlx(&vc->double_ms));
+
+	/* the detectors may live on, but the call is gone */
+	vad_call_remove(vc);
+}
+
+
+static const struct cmd cmdv[] = {
+	{"fvad_bench", 0, CMD_PRM, "VAD benchmark over WAV files", cmd_bench},
+	{"fvad_calls", 0, 0,       "VAD talk time per call",       cmd_calls},
+	{"fvad_stats", 0, 0,       "VAD filter statistics",        cmd_stats},
+};
+
+
 static int module_init(void)
 {
 	struct conf *conf = conf_cur();
 
+	struct pl engine;
+	vad_cfg.eng = &vad_eng_fvad;
+	if (!conf_get(conf, "fvad_engine", &engine)) {
+		vad_cfg.eng = engine_find(&engine);
+		if (!vad_cfg.eng) {
+			warning("fvad: unknown engine '%r'\n", &engine);
+			return EINVAL;
+		}
+	}
+
+	conf_get_u32(conf, "fvad_ratio", &vad_cfg.ratio);
+	conf_get_u32(conf, "fvad_attack", &vad_cfg.attack);
+	conf_get_u32(conf, "fvad_hangover", &vad_cfg.hangover);
+	if (vad_cfg.ratio > 100)
+		vad_cfg.ratio = 100;
+
+	conf_get_bool(conf, "fvad_pregate", &vad_cfg.pregate);
+	conf_get_u32(conf, "fvad_pregate_db", &vad_cfg.pregate_db);
+	vad_cfg.pregate_db = min(vad_cfg.pregate_db, 40);
+	vad_cfg.margin = pow(10.0, vad_cfg.pregate_db / 10.0);
+
+	conf_get_bool(conf, "fvad_async", &vad_cfg.async);
+	conf_get_u32(conf, "fvad_workers", &vad_cfg.workers);
+	conf_get_bool(conf, "fvad_dtx", &vad_cfg.dtx);
+	conf_get_u32(conf, "fvad_dtx_cn", &vad_cfg.dtx_cn);
+	conf_get_bool(conf, "fvad_record", &vad_cfg.record);
+	conf_get_u32(conf, "fvad_record_preroll", &vad_cfg.preroll);
+	vad_cfg.preroll = min(vad_cfg.preroll, MAX_PREROLL);
+
 	bool rx_enabled = true;
 	conf_get_bool(conf, "fvad_rx", &rx_enabled);
 
@@ -334,17 +1755,71 @@ static int module_init(void)
 		return 0;
 	}
 
+	if (vad_cfg.record) {
+		char path[256] = ".";
+
+		(void)conf_get_str(conf, "fvad_record_path", path,
+				   sizeof(path));
+
+		int err = vad_rec_init(path);
+		if (err) {
+			warning("fvad: recorder failed (%m)\n", err);
+			return err;
+		}
+	}
+
+	if (vad_cfg.async) {
+		int err = mqueue_alloc(&vad_mq, mqueue_handler, NULL);
+		if (err) {
+			vad_rec_terminate();
+			return err;
+		}
+
+		err = vad_pool_init(vad_cfg.workers);
+		if (err) {
+			warning("fvad: worker pool with %u threads failed "
+				"(%m)\n", vad_cfg.workers, err);
+			vad_mq = mem_deref(vad_mq);
+			vad_rec_terminate();
+			return err;
+		}
+	}
+
+	int err  = hash_alloc(&vad_callh, CALL_HASH_SIZE);
+	err |= hash_alloc(&vad_audioh, CALL_HASH_SIZE);
+	if (!err)
+		err = uag_event_register(ua_event_handler, NULL);
+	if (err) {
+		vad_callh  = mem_deref(vad_callh);
+		vad_audioh = mem_deref(vad_audioh);
+		return err;
+	}
+
 	aufilt_register(baresip_aufiltl(), &vad);
 
-	return 0;
+	return cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 }
 
 
 static int module_close(void)
 {
+	cmd_unregister(baresip_commands(), cmdv);
+
+	uag_event_unregister(ua_event_handler);
+
 	if (vad.dech || vad.ench)
 		aufilt_unregister(&vad);
 
+	vad_pool_close();
+	vad_rec_terminate();
+	vad_mq = mem_deref(vad_mq);
+
+	hash_clear(vad_callh);
+	hash_clear(vad_audioh);
+	list_flush(&vad_calls);
+	vad_callh  = mem_deref(vad_callh);
+	vad_audioh = mem_deref(vad_audioh);
+
 	return 0;
 }
 
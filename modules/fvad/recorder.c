@@ -0,0 +1,390 @@
+/**
+ * @file recorder.c  VAD-triggered segment recorder
+ *
+ * Every detector with a recorder owns a ring of preallocated frame
+ * buffers. The detector copies each frame into the next buffer and hands
+ * the buffers over to a shared writer thread by advancing the ring head.
+ * Outside of a segment only the pre-roll is kept; older buffers are handed
+ * over marked as discarded. The writer thread opens a WAV file at the
+ * first buffer of a segment, writes the buffers and closes the file at the
+ * end of the segment.
+ *
+ * A recorder is referenced by its detector and by the writer list. When the
+ * writer is terminated first, the recorder is detached and the detector
+ * keeps the last reference.
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include <re_atomic.h>
+#include <baresip.h>
+#include "vad.h"
+
+
+enum {
+	REC_BUFS   = 128,                   /* frame buffers per recorder */
+	REC_SAMPC  = VAD_MAX_FRAMESZ / 2,
+	REC_SRATE  = 8000,
+	WAIT_MS    = 20,
+};
+
+
+enum rec_flag {
+	REC_START   = 1 << 0,  /* first buffer of a segment  */
+	REC_END     = 1 << 1,  /* last buffer of a segment   */
+	REC_DISCARD = 1 << 2,  /* dropped from the pre-roll  */
+};
+
+
+struct rec_buf {
+	int16_t sampv[REC_SAMPC];
+	size_t sampc;
+	uint32_t flags;
+};
+
+
+struct vad_rec {
+	struct le le;
+	char *name;
+	uint32_t preroll;             /* [ms]                          */
+
+	/* detector thread */
+	uint32_t wr;                  /* next buffer to fill           */
+	bool seg;                     /* segment open                  */
+
+	/* writer thread */
+	struct aufile *af;
+	uint32_t segc;
+
+	RE_ATOMIC uint32_t head;      /* handed over to the writer     */
+	RE_ATOMIC uint32_t tail;      /* released by the writer        */
+	RE_ATOMIC bool closed;
+	RE_ATOMIC bool detached;      /* the writer is terminated      */
+	struct rec_buf bufv[REC_BUFS];
+};
+
+
+static struct {
+	char *path;
+	thrd_t tid;
+	mtx_t *mtx;
+	cnd_t cnd;
+	struct list recl;
+	RE_ATOMIC bool run;
+
+	RE_ATOMIC uint64_t segments;
+	RE_ATOMIC uint64_t frames;
+	RE_ATOMIC uint64_t overruns;
+} rec;
+
+
+static void destructor(void *arg)
+{
+	struct vad_rec *r = arg;
+
+	mem_deref(r->af);
+	mem_deref(r->name);
+}
+
+
+static void segment_open(struct vad_rec *r)
+{
+	struct aufile_prm prm = { REC_SRATE, 1, AUFMT_S16LE };
+	char *file = NULL;
+
+	r->af = mem_deref(r->af);
+
+	if (re_sdprintf(&file, "%s/%s-%u.wav", rec.path, r->name,
+			++r->segc))
+		return;
+
+	int err = aufile_open(&r->af, &prm, file, AUFILE_WRITE);
+	if (err)
+		warning("fvad: recorder: could not open %s (%m)\n",
+			file, err);
+	else
+		re_atomic_rlx_add(&rec.segments, 1);
+
+	mem_deref(file);
+}
+
+
+static bool rec_drain(struct vad_rec *r)
+{
+	uint32_t t = re_atomic_rlx(&r->tail);
+	const uint32_t h = re_atomic_acq(&r->head);
+
+	if (t == h)
+		return false;
+
+	for (; t != h; t++) {
+		const struct rec_buf *buf = &r->bufv[t % REC_BUFS];
+
+		if (buf->flags & REC_START)
+			segment_open(r);
+
+		if (!(buf->flags & REC_DISCARD) && r->af) {
+			(void)aufile_write(r->af, (const uint8_t *)buf->sampv,
+					   buf->sampc * sizeof(int16_t));
+			re_atomic_rlx_add(&rec.frames, 1);
+		}
+
+		if (buf->flags & REC_END)
+			r->af = mem_deref(r->af);
+
+		re_atomic_rls_set(&r->tail, t + 1);
+	}
+
+	return true;
+}
+
+
+static int writer_thread(void *arg)
+{
+	(void)arg;
+
+	mtx_lock(rec.mtx);
+	while (re_atomic_rlx(&rec.run)) {
+		struct le *le = list_head(&rec.recl);
+
+		while (le) {
+			struct vad_rec *r = le->data;
+			le = le->next;
+
+			/* the file I/O runs without the lock */
+			mtx_unlock(rec.mtx);
+			(void)rec_drain(r);
+			mtx_lock(rec.mtx);
+
+			if (re_atomic_acq(&r->closed)) {
+				(void)rec_drain(r);
+				list_unlink(&r->le);
+				mem_deref(r);
+			}
+		}
+
+		struct timespec ts;
+		timespec_get(&ts, TIME_UTC);
+		ts.tv_nsec += WAIT_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec  += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		(void)cnd_timedwait(&rec.cnd, rec.mtx, &ts);
+	}
+	mtx_unlock(rec.mtx);
+
+	return 0;
+}
+
+
+/**
+ * Allocate a segment recorder
+ *
+ * @param recp    Pointer to allocated recorder
+ * @param name    File name prefix
+ * @param preroll Pre-roll in [ms]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vad_rec_alloc(struct vad_rec **recp, const char *name, uint32_t preroll)
+{
+	struct vad_rec *r;
+
+	if (!recp || !name || !rec.mtx)
+		return EINVAL;
+
+	r = mem_zalloc(sizeof(*r), destructor);
+	if (!r)
+		return ENOMEM;
+
+	int err = str_dup(&r->name, name);
+	if (err) {
+		mem_deref(r);
+		return err;
+	}
+
+	r->preroll = preroll;
+
+	/* the writer list holds its own reference */
+	mtx_lock(rec.mtx);
+	list_append(&rec.recl, &r->le, mem_ref(r));
+	mtx_unlock(rec.mtx);
+
+	*recp = r;
+	return 0;
+}
+
+
+/**
+ * Hand over an audio frame to the recorder
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param r      Recorder
+ * @param af     Audio frame (mono S16LE, 8 kHz)
+ * @param active VAD state
+ */
+void vad_rec_frame(struct vad_rec *r, const struct auframe *af, bool active)
+{
+	if (!r || af->sampc > REC_SAMPC || re_atomic_acq(&r->detached))
+		return;
+
+	if (r->wr - re_atomic_acq(&r->tail) >= REC_BUFS) {
+		re_atomic_rlx_add(&rec.overruns, 1);
+		return;
+	}
+
+	struct rec_buf *buf = &r->bufv[r->wr % REC_BUFS];
+	uint32_t head = re_atomic_rlx(&r->head);
+
+	memcpy(buf->sampv, af->sampv, af->sampc * sizeof(int16_t));
+	buf->sampc = af->sampc;
+	buf->flags = 0;
+	++r->wr;
+
+	if (active) {
+		if (!r->seg) {
+			r->bufv[head % REC_BUFS].flags |= REC_START;
+			r->seg = true;
+		}
+
+		head = r->wr;
+	}
+	else if (r->seg) {
+		buf->flags |= REC_END;
+		r->seg = false;
+		head = r->wr;
+	}
+	else {
+		const uint32_t ms = (uint32_t)(af->sampc * 1000 / REC_SRATE);
+
+		/* keep the pre-roll, hand over the older buffers */
+		while ((r->wr - head) * ms > r->preroll) {
+			r->bufv[head % REC_BUFS].flags = REC_DISCARD;
+			++head;
+		}
+	}
+
+	re_atomic_rls_set(&r->head, head);
+}
+
+
+/**
+ * Close a recorder and release the caller's reference, the writer thread
+ * writes the pending buffers, closes the open segment and releases its own
+ * reference
+ *
+ * @param r Recorder
+ */
+void vad_rec_close(struct vad_rec *r)
+{
+	if (!r)
+		return;
+
+	re_atomic_rls_set(&r->closed, true);
+	if (!re_atomic_acq(&r->detached))
+		cnd_signal(&rec.cnd);
+
+	mem_deref(r);
+}
+
+
+/**
+ * Print the recorder statistics
+ *
+ * @param pf Print handler
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vad_rec_print(struct re_printf *pf)
+{
+	if (!rec.mtx)
+		return 0;
+
+	return re_hprintf(pf, "fvad recorder path=%s segments=%llu "
+			  "frames=%llu overruns=%llu\n", rec.path,
+			  re_atomic_rlx(&rec.segments),
+			  re_atomic_rlx(&rec.frames),
+			  re_atomic_rlx(&rec.overruns));
+}
+
+
+/**
+ * Start the writer thread
+ *
+ * @param path Directory of the segment files
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vad_rec_init(const char *path)
+{
+	int err;
+
+	if (!path)
+		return EINVAL;
+
+	err = str_dup(&rec.path, path);
+	if (err)
+		return err;
+
+	err = mutex_alloc(&rec.mtx);
+	if (err)
+		goto out;
+
+	if (cnd_init(&rec.cnd) != thrd_success) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	re_atomic_rlx_set(&rec.run, true);
+	err = thread_create_name(&rec.tid, "fvad rec", writer_thread, NULL);
+	if (err) {
+		re_atomic_rlx_set(&rec.run, false);
+		cnd_destroy(&rec.cnd);
+	}
+
+ out:
+	if (err) {
+		rec.mtx  = mem_deref(rec.mtx);
+		rec.path = mem_deref(rec.path);
+	}
+
+	return err;
+}
+
+
+/**
+ * Stop the writer thread and release all recorders
+ */
+void vad_rec_terminate(void)
+{
+	struct le *le;
+
+	if (!rec.mtx)
+		return;
+
+	re_atomic_rlx_set(&rec.run, false);
+	mtx_lock(rec.mtx);
+	cnd_signal(&rec.cnd);
+	mtx_unlock(rec.mtx);
+	thrd_join(rec.tid, NULL);
+
+	/* the detectors may still hold their recorders */
+	for (le = list_head(&rec.recl); le; le = le->next) {
+		struct vad_rec *r = le->data;
+
+		re_atomic_rls_set(&r->detached, true);
+		(void)rec_drain(r);
+		r->af = mem_deref(r->af);
+	}
+
+	list_flush(&rec.recl);
+	cnd_destroy(&rec.cnd);
+	rec.mtx  = mem_deref(rec.mtx);
+	rec.path = mem_deref(rec.path);
+}
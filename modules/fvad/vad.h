@@ -0,0 +1,62 @@
+/**
+ * @file vad.h  Voice Activity Detection -- internal interface
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+
+enum {
+	VAD_MAX_FRAMESZ = 960 * 2,  /* 120 ms @ 8 kHz mono S16LE [bytes] */
+};
+
+
+/*
+ * Worker pool
+ */
+
+struct vad_queue;
+
+typedef void (vad_work_h)(const struct auframe *af, void *arg);
+
+int  vad_queue_alloc(struct vad_queue **qp, vad_work_h *workh, void *arg);
+bool vad_queue_push(struct vad_queue *q, const struct auframe *af);
+void vad_queue_close(struct vad_queue *q);
+
+int  vad_pool_init(uint32_t workers);
+void vad_pool_close(void);
+
+
+/*
+ * Engines
+ *
+ * An engine gets mono S16LE frames at 8 kHz and returns the voiced ratio of
+ * the frame in [%]. The state is a mem object.
+ */
+
+typedef int      (vad_eng_alloc_h)(void **stp);
+typedef uint32_t (vad_eng_proc_h)(void *st, const struct auframe *af);
+
+struct vad_engine {
+	const char *name;
+	vad_eng_alloc_h *alloch;
+	vad_eng_proc_h *proch;
+};
+
+extern const struct vad_engine vad_eng_energy;
+extern const struct vad_engine vad_eng_sflat;
+
+
+/*
+ * Segment recorder
+ */
+
+struct vad_rec;
+
+int  vad_rec_alloc(struct vad_rec **recp, const char *name,
+		   uint32_t preroll);
+void vad_rec_frame(struct vad_rec *r, const struct auframe *af,
+		   bool active);
+void vad_rec_close(struct vad_rec *r);
+int  vad_rec_print(struct re_printf *pf);
+int  vad_rec_init(const char *path);
+void vad_rec_terminate(void);
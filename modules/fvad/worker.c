@@ -0,0 +1,338 @@
+/**
+ * @file worker.c  Shared VAD worker pool
+ *
+ * Every filter state gets a single-producer/single-consumer ring. The audio
+ * thread copies the frame into the ring and signals the worker, which owns
+ * the ring and runs the detector. The audio path never blocks; if the ring
+ * is full the frame is dropped. The worker takes a snapshot of its queues
+ * under the lock and runs the detectors without it.
+ *
+ * A queue is referenced by the filter state and by the worker list. When
+ * the pool is closed first, the queue is detached and the filter state
+ * keeps the last reference.
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include <re_atomic.h>
+#include <baresip.h>
+#include "vad.h"
+
+
+enum {
+	QUEUE_SIZE  = 4,     /* frames per ring                */
+	WAIT_MS     = 10,    /* worker wait without a signal   */
+	MAX_WORKERS = 16,
+};
+
+
+struct vad_slot {
+	struct auframe af;
+	uint8_t buf[VAD_MAX_FRAMESZ];
+};
+
+
+struct vad_worker;
+
+struct vad_queue {
+	struct le le;
+	vad_work_h *workh;
+	void *arg;
+	struct vad_worker *w;
+
+	RE_ATOMIC uint32_t head;   /* written by the audio thread */
+	RE_ATOMIC uint32_t tail;   /* written by the worker       */
+	RE_ATOMIC bool closed;
+	RE_ATOMIC bool detached;   /* the pool is closed          */
+	struct vad_slot slotv[QUEUE_SIZE];
+};
+
+
+struct vad_worker {
+	thrd_t tid;
+	mtx_t *mtx;
+	cnd_t cnd;
+	struct list queuel;
+	struct vad_queue **snapv;  /* owned by the worker thread */
+	uint32_t snapc;
+	RE_ATOMIC bool run;
+};
+
+
+static struct {
+	struct vad_worker *workerv;
+	uint32_t workerc;
+	RE_ATOMIC uint32_t next;
+} pool;
+
+
+static void queue_destructor(void *arg)
+{
+	struct vad_queue *q = arg;
+
+	mem_deref(q->arg);
+}
+
+
+static bool queue_process(struct vad_queue *q)
+{
+	uint32_t t = re_atomic_rlx(&q->tail);
+	const uint32_t h = re_atomic_acq(&q->head);
+
+	if (t == h)
+		return false;
+
+	for (; t != h; t++) {
+		q->workh(&q->slotv[t % QUEUE_SIZE].af, q->arg);
+		re_atomic_rls_set(&q->tail, t + 1);
+	}
+
+	return true;
+}
+
+
+/* release the closed queues and take a snapshot of the others */
+static uint32_t queue_snapshot(struct vad_worker *w)
+{
+	const uint32_t count = list_count(&w->queuel);
+	struct le *le = list_head(&w->queuel);
+	uint32_t n = 0;
+
+	if (count > w->snapc) {
+		struct vad_queue **snapv;
+
+		snapv = mem_realloc(w->snapv, count * sizeof(*snapv));
+		if (snapv) {
+			w->snapv = snapv;
+			w->snapc = count;
+		}
+	}
+
+	while (le) {
+		struct vad_queue *q = le->data;
+		le = le->next;
+
+		if (re_atomic_acq(&q->closed)) {
+			list_unlink(&q->le);
+			mem_deref(q);
+			continue;
+		}
+
+		if (n < w->snapc)
+			w->snapv[n++] = q;
+	}
+
+	return n;
+}
+
+
+static int worker_thread(void *arg)
+{
+	struct vad_worker *w = arg;
+
+	mtx_lock(w->mtx);
+	while (re_atomic_rlx(&w->run)) {
+		const uint32_t n = queue_snapshot(w);
+		bool work = false;
+
+		/* a new queue is added under the lock, no wakeup is lost */
+		if (!n) {
+			cnd_wait(&w->cnd, w->mtx);
+			continue;
+		}
+
+		/* only this thread releases the queues */
+		mtx_unlock(w->mtx);
+		for (uint32_t i = 0; i < n; i++)
+			work |= queue_process(w->snapv[i]);
+		mtx_lock(w->mtx);
+
+		if (work)
+			continue;
+
+		struct timespec ts;
+		timespec_get(&ts, TIME_UTC);
+		ts.tv_nsec += WAIT_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec  += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		(void)cnd_timedwait(&w->cnd, w->mtx, &ts);
+	}
+	mtx_unlock(w->mtx);
+
+	return 0;
+}
+
+
+/**
+ * Allocate a frame queue served by the worker pool
+ *
+ * @param qp    Pointer to allocated queue
+ * @param workh Work handler, called from a worker thread
+ * @param arg   Handler argument, dereferenced with the queue
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vad_queue_alloc(struct vad_queue **qp, vad_work_h *workh, void *arg)
+{
+	struct vad_queue *q;
+
+	if (!qp || !workh || !pool.workerc)
+		return EINVAL;
+
+	q = mem_zalloc(sizeof(*q), queue_destructor);
+	if (!q)
+		return ENOMEM;
+
+	q->workh = workh;
+	q->arg   = arg;
+	q->w     = &pool.workerv[re_atomic_rlx_add(&pool.next, 1) %
+				 pool.workerc];
+
+	/* the worker list holds its own reference */
+	mtx_lock(q->w->mtx);
+	list_append(&q->w->queuel, &q->le, mem_ref(q));
+	cnd_signal(&q->w->cnd);
+	mtx_unlock(q->w->mtx);
+
+	*qp = q;
+	return 0;
+}
+
+
+/**
+ * Copy an audio frame into the queue
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param q  Frame queue
+ * @param af Audio frame
+ *
+ * @return true if queued, false if the queue is full or the frame too large
+ */
+bool vad_queue_push(struct vad_queue *q, const struct auframe *af)
+{
+	const uint32_t h = re_atomic_rlx(&q->head);
+	const size_t sz = auframe_size(af);
+
+	if (re_atomic_acq(&q->detached))
+		return false;
+
+	if (h - re_atomic_acq(&q->tail) >= QUEUE_SIZE || sz > VAD_MAX_FRAMESZ)
+		return false;
+
+	struct vad_slot *slot = &q->slotv[h % QUEUE_SIZE];
+
+	memcpy(slot->buf, af->sampv, sz);
+	slot->af = *af;
+	slot->af.sampv = slot->buf;
+
+	re_atomic_rls_set(&q->head, h + 1);
+	cnd_signal(&q->w->cnd);
+
+	return true;
+}
+
+
+/**
+ * Close a queue and release the caller's reference, the worker releases
+ * its own reference and the queue argument
+ *
+ * @param q Frame queue
+ */
+void vad_queue_close(struct vad_queue *q)
+{
+	if (!q)
+		return;
+
+	re_atomic_rls_set(&q->closed, true);
+	if (!re_atomic_acq(&q->detached))
+		cnd_signal(&q->w->cnd);
+
+	mem_deref(q);
+}
+
+
+/**
+ * Start the worker pool
+ *
+ * @param workers Number of worker threads
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vad_pool_init(uint32_t workers)
+{
+	int err = 0;
+
+	if (!workers || workers > MAX_WORKERS)
+		return EINVAL;
+
+	pool.workerv = mem_zalloc(workers * sizeof(*pool.workerv), NULL);
+	if (!pool.workerv)
+		return ENOMEM;
+
+	for (uint32_t i = 0; i < workers; i++) {
+		struct vad_worker *w = &pool.workerv[i];
+
+		err  = mutex_alloc(&w->mtx);
+		err |= cnd_init(&w->cnd) != thrd_success;
+		if (err) {
+			w->mtx = mem_deref(w->mtx);
+			break;
+		}
+
+		re_atomic_rlx_set(&w->run, true);
+		err = thread_create_name(&w->tid, "fvad", worker_thread, w);
+		if (err) {
+			re_atomic_rlx_set(&w->run, false);
+			cnd_destroy(&w->cnd);
+			w->mtx = mem_deref(w->mtx);
+			break;
+		}
+
+		pool.workerc = i + 1;
+	}
+
+	if (err)
+		vad_pool_close();
+
+	return err;
+}
+
+
+/**
+ * Stop the worker pool and release all queues
+ */
+void vad_pool_close(void)
+{
+	for (uint32_t i = 0; i < pool.workerc; i++) {
+		struct vad_worker *w = &pool.workerv[i];
+		struct le *le;
+
+		re_atomic_rlx_set(&w->run, false);
+		mtx_lock(w->mtx);
+		cnd_signal(&w->cnd);
+		mtx_unlock(w->mtx);
+		thrd_join(w->tid, NULL);
+
+		/* the filter states may still hold their queues */
+		LIST_FOREACH(&w->queuel, le) {
+			struct vad_queue *q = le->data;
+
+			re_atomic_rls_set(&q->detached, true);
+		}
+
+		list_flush(&w->queuel);
+		w->snapv = mem_deref(w->snapv);
+		cnd_destroy(&w->cnd);
+		w->mtx = mem_deref(w->mtx);
+	}
+
+	pool.workerc = 0;
+	pool.workerv = mem_deref(pool.workerv);
+}
@@ -0,0 +1,500 @@
+/**
+ * @file bench.c  Loopback multicast load generator and benchmark
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcbench"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+enum {
+	SEQ_WIN  = 1024,            /**< Send timestamp window [packets]  */
+	GRACE    = 500,             /**< Wait for late packets in [ms]    */
+	LAT_RES  = 256,             /**< Latency samples reserve          */
+};
+
+
+/**
+ * Synthetic RTP stream of the benchmark
+ */
+struct bench_stream {
+	struct sa addr;
+	uint8_t prio;
+	struct udp_sock *us;
+	struct tmr tmr;
+
+	uint16_t seq;
+	uint32_t ts;
+	uint32_t ssrc;
+	uint64_t t_next;
+	uint64_t t_start;
+	uint64_t t_running;
+	uint64_t sendv[SEQ_WIN];
+
+	uint32_t sent;
+	uint32_t lost;
+	uint32_t recv;
+	bool reg;
+
+	uint32_t *latv;
+	size_t latc;
+	size_t latn;
+};
+
+
+/**
+ * Multicast benchmark
+ *
+ * Stream 0 has the highest priority and starts after the half of the
+ * benchmark time to measure the priority switch latency.
+ */
+struct mcbench {
+	struct mcbench_prm prm;
+	struct auenc_state *enc;
+	struct mbuf *payload;
+	uint8_t pt;
+
+	struct tmr tmr_switch;
+	struct tmr tmr_stop;
+	struct tmr tmr_end;
+
+	uint64_t t_start;
+	uint64_t cpu_start;
+
+	struct bench_stream *streamv;
+};
+
+
+static struct mcbench *bench;
+
+
+static uint64_t cpu_usec(void)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+
+static void mcbench_destructor(void *arg)
+{
+	struct mcbench *b = arg;
+	uint32_t i;
+
+	tmr_cancel(&b->tmr_switch);
+	tmr_cancel(&b->tmr_stop);
+	tmr_cancel(&b->tmr_end);
+
+	for (i = 0; b->streamv && i < b->prm.streams; i++) {
+		struct bench_stream *st = &b->streamv[i];
+
+		tmr_cancel(&st->tmr);
+		mem_deref(st->us);
+		mem_deref(st->latv);
+		if (st->reg)
+			mcreceiver_unreg(&st->addr);
+	}
+
+	mem_deref(b->streamv);
+	mem_deref(b->payload);
+	mem_deref(b->enc);
+}
+
+
+/**
+ * Encode one packet time of silence which is sent by all streams
+ *
+ * @param b Multicast benchmark
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int payload_alloc(struct mcbench *b)
+{
+	const struct aucodec *ac = b->prm.ac;
+	struct auenc_param prm;
+	int16_t *sampv;
+	size_t sampc;
+	size_t len;
+	bool marker = false;
+	int err;
+
+	sampc = ac->srate * ac->ch * b->prm.ptime / 1000;
+	sampv = mem_zalloc(sampc * sizeof(*sampv), NULL);
+	b->payload = mbuf_alloc(AUDIO_SAMPSZ);
+	if (!sampv || !b->payload) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (ac->encupdh) {
+		prm.bitrate = 0;
+		err = ac->encupdh(&b->enc, ac, &prm, NULL);
+		if (err)
+			goto out;
+	}
+
+	len = mbuf_get_space(b->payload);
+	err = ac->ench(b->enc, &marker, mbuf_buf(b->payload), &len,
+		AUFMT_S16LE, sampv, sampc);
+	if (err)
+		goto out;
+
+	b->payload->end = len;
+
+  out:
+	mem_deref(sampv);
+	return err;
+}
+
+
+static void stream_send(struct bench_stream *st)
+{
+	struct rtp_header hdr;
+	struct mbuf *mb;
+	uint64_t now;
+	int err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver  = RTP_VERSION;
+	hdr.m    = st->sent == 0 && st->lost == 0;
+	hdr.pt   = bench->pt;
+	hdr.seq  = st->seq++;
+	hdr.ts   = st->ts;
+	hdr.ssrc = st->ssrc;
+
+	st->ts += bench->prm.ac->crate * bench->prm.ptime / 1000;
+
+	if (bench->prm.loss && rand_u32() % 100 < bench->prm.loss) {
+		++st->lost;
+		return;
+	}
+
+	mb = mbuf_alloc(RTP_HEADER_SIZE + mbuf_get_left(bench->payload));
+	if (!mb)
+		return;
+
+	err  = rtp_hdr_encode(mb, &hdr);
+	err |= mbuf_write_mem(mb, mbuf_buf(bench->payload),
+		mbuf_get_left(bench->payload));
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+	now = tmr_jiffies_usec();
+	if (!st->t_start)
+		st->t_start = now;
+
+	st->sendv[hdr.seq % SEQ_WIN] = now;
+	err = udp_send(st->us, &st->addr, mb);
+	if (err) {
+		warning("multicast bench: send to %J (%m)\n", &st->addr, err);
+		goto out;
+	}
+
+	++st->sent;
+
+  out:
+	mem_deref(mb);
+}
+
+
+static void stream_handler(void *arg)
+{
+	struct bench_stream *st = arg;
+	uint64_t now;
+
+	stream_send(st);
+
+	st->t_next += bench->prm.ptime;
+	now = tmr_jiffies();
+	tmr_start(&st->tmr, st->t_next > now ? st->t_next - now : 0,
+		stream_handler, st);
+}
+
+
+static void stream_start(struct bench_stream *st)
+{
+	st->t_next = tmr_jiffies();
+	tmr_start(&st->tmr, 0, stream_handler, st);
+}
+
+
+static void switch_handler(void *arg)
+{
+	(void)arg;
+
+	stream_start(&bench->streamv[0]);
+}
+
+
+static void stop_handler(void *arg)
+{
+	uint32_t i;
+	(void)arg;
+
+	for (i = 0; i < bench->prm.streams; i++)
+		tmr_cancel(&bench->streamv[i].tmr);
+}
+
+
+static int latency_cmp(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a;
+	uint32_t lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+
+static uint32_t percentile(const uint32_t *v, size_t n, unsigned p)
+{
+	if (!n)
+		return 0;
+
+	return v[(n - 1) * p / 100];
+}
+
+
+/**
+ * Write the benchmark results as CSV
+ *
+ * @param b   Multicast benchmark
+ * @param cpu CPU usage per stream in [%]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int write_csv(struct mcbench *b, double cpu)
+{
+	FILE *f;
+	uint32_t i;
+
+	f = fopen(b->prm.csv, "w");
+	if (!f)
+		return errno;
+
+	(void)fprintf(f, "streams,codec,ptime,loss,stream,prio,sent,lost,"
+		"received,dropped,lat_p50_us,lat_p95_us,lat_p99_us,"
+		"lat_max_us,switch_us,cpu_percent\n");
+
+	for (i = 0; i < b->prm.streams; i++) {
+		struct bench_stream *st = &b->streamv[i];
+		int64_t sw = -1;
+
+		if (st->t_running)
+			sw = (int64_t)(st->t_running - st->t_start);
+
+		qsort(st->latv, st->latn, sizeof(*st->latv), latency_cmp);
+
+		(void)fprintf(f, "%u,%s,%u,%u,%u,%u,%u,%u,%u,%u,"
+			"%u,%u,%u,%u,%lld,%.2f\n",
+			b->prm.streams, b->prm.ac->name, b->prm.ptime,
+			b->prm.loss, i, st->prio, st->sent, st->lost,
+			st->recv, st->sent > st->recv ?
+			st->sent - st->recv : 0,
+			percentile(st->latv, st->latn, 50),
+			percentile(st->latv, st->latn, 95),
+			percentile(st->latv, st->latn, 99),
+			percentile(st->latv, st->latn, 100),
+			(long long)sw, cpu);
+	}
+
+	(void)fclose(f);
+	return 0;
+}
+
+
+static void end_handler(void *arg)
+{
+	uint64_t wall = tmr_jiffies_usec() - bench->t_start;
+	double cpu = 0.0;
+	int err;
+	(void)arg;
+
+	if (wall)
+		cpu = 100.0 * (double)(cpu_usec() - bench->cpu_start) /
+			(double)wall / bench->prm.streams;
+
+	err = write_csv(bench, cpu);
+	if (err) {
+		warning("multicast bench: write %s (%m)\n", bench->prm.csv,
+			err);
+	}
+	else {
+		info("multicast bench: %u streams finished, results in %s\n",
+			bench->prm.streams, bench->prm.csv);
+	}
+
+	module_event("multicast", "bench done", NULL, NULL, "streams=%u "
+		"csv=%s err=%d", bench->prm.streams, bench->prm.csv, err);
+
+	bench = mem_deref(bench);
+}
+
+
+/**
+ * Account a received RTP packet of a benchmark stream
+ *
+ * @note Called by the receiver for every RTP packet, returns immediately if
+ * no benchmark is running
+ *
+ * @param addr    Listen address of the receiver
+ * @param hdr     RTP header
+ * @param running True if the receiver is playing the stream
+ */
+void mcbench_rtp(const struct sa *addr, const struct rtp_header *hdr,
+	bool running)
+{
+	struct bench_stream *st;
+	uint64_t now;
+	uint32_t i;
+
+	if (!bench || !addr || !hdr)
+		return;
+
+	i = (sa_port(addr) - sa_port(&bench->prm.addr)) / 2;
+	if (i >= bench->prm.streams)
+		return;
+
+	st = &bench->streamv[i];
+	if (!sa_cmp(addr, &st->addr, SA_ALL) || hdr->ssrc != st->ssrc)
+		return;
+
+	now = tmr_jiffies_usec();
+	++st->recv;
+	if (running && !st->t_running)
+		st->t_running = now;
+
+	if (st->latn == st->latc) {
+		uint32_t *latv = mem_realloc(st->latv,
+			(st->latc + LAT_RES) * sizeof(*latv));
+		if (!latv)
+			return;
+
+		st->latv = latv;
+		st->latc += LAT_RES;
+	}
+
+	now -= st->sendv[hdr->seq % SEQ_WIN];
+	st->latv[st->latn++] = (uint32_t)now;
+}
+
+
+/**
+ * Start a multicast benchmark
+ *
+ * Allocates one receiver per stream on consecutive even ports starting at
+ * the given address. The receivers use the configured player zones, which
+ * should output to a null audio device.
+ *
+ * @param prm Benchmark parameters
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcbench_start(const struct mcbench_prm *prm)
+{
+	struct sa laddr;
+	uint32_t i;
+	int err = 0;
+
+	if (!prm || !prm->ac || !prm->ac->ench || !prm->streams ||
+	    prm->streams > 255 || !prm->ptime || prm->ptime > MAX_PTIME ||
+	    prm->loss > 100 || !prm->duration || !str_isset(prm->csv))
+		return EINVAL;
+
+	if (bench)
+		return EBUSY;
+
+	bench = mem_zalloc(sizeof(*bench), mcbench_destructor);
+	if (!bench)
+		return ENOMEM;
+
+	bench->prm = *prm;
+	bench->pt  = (uint8_t)atoi(prm->ac->pt);
+	bench->streamv = mem_zalloc(prm->streams * sizeof(*bench->streamv),
+		NULL);
+	if (!bench->streamv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = payload_alloc(bench);
+	if (err) {
+		warning("multicast bench: %s encoder (%m)\n", prm->ac->name,
+			err);
+		goto out;
+	}
+
+	sa_init(&laddr, sa_af(&prm->addr));
+	for (i = 0; i < prm->streams; i++) {
+		struct bench_stream *st = &bench->streamv[i];
+
+		sa_cpy(&st->addr, &prm->addr);
+		sa_set_port(&st->addr, sa_port(&prm->addr) + 2 * i);
+		st->prio = (uint8_t)(i + 1);
+		st->ssrc = rand_u32();
+		st->seq  = rand_u16();
+		tmr_init(&st->tmr);
+
+		err = mcreceiver_alloc(&st->addr, st->prio, NULL);
+		if (err)
+			goto out;
+
+		st->reg = true;
+		err = udp_listen(&st->us, &laddr, NULL, NULL);
+		if (err)
+			goto out;
+	}
+
+	bench->t_start   = tmr_jiffies_usec();
+	bench->cpu_start = cpu_usec();
+
+	for (i = 1; i < prm->streams; i++)
+		stream_start(&bench->streamv[i]);
+
+	tmr_start(&bench->tmr_switch, prm->duration * 1000 / 2,
+		switch_handler, NULL);
+	tmr_start(&bench->tmr_stop, prm->duration * 1000, stop_handler,
+		NULL);
+	tmr_start(&bench->tmr_end, prm->duration * 1000 + GRACE,
+		end_handler, NULL);
+
+	info("multicast bench: %u streams codec=%s ptime=%u loss=%u%% "
+		"time=%us\n", prm->streams, prm->ac->name, prm->ptime,
+		prm->loss, prm->duration);
+
+  out:
+	if (err)
+		bench = mem_deref(bench);
+
+	return err;
+}
+
+
+/**
+ * Stop a running benchmark without results
+ */
+void mcbench_terminate(void)
+{
+	bench = mem_deref(bench);
+}
@@ -0,0 +1,247 @@
+/**
+ * @file event.c  Rate-limited multicast receiver events
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcevent"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+enum {
+	EVENT_QSIZE    = 64,        /**< Maximum number of pending events */
+	EVENT_INTERVAL = 100,       /**< Minimum drain interval in [ms]   */
+};
+
+
+/**
+ * Event record, formatted when the queue is drained
+ */
+struct mcevent {
+	enum mcevent_type type;
+	struct sa addr;
+	uint8_t prio;
+	bool enable;
+	const char *state;
+	uint32_t count;
+};
+
+
+static const struct {
+	const char *name;
+	const char *log;
+} eventv[MCEVENT_MAX] = {
+	{"receiver start",           "start"  },
+	{"receiver restart",         "restart"},
+	{"receiver stopped playing", NULL     },
+	{"receiver EOS",             "EOS"    },
+};
+
+
+static struct {
+	mtx_t *mtx;
+	struct mqueue *mq;
+	struct tmr tmr;
+	uint64_t last;
+	bool scheduled;
+
+	struct mcevent qv[EVENT_QSIZE];
+	size_t qn;
+
+	uint64_t emitted;
+	uint64_t coalesced;
+	uint64_t dropped;
+} evq;
+
+
+/**
+ * Format and emit all pending events
+ *
+ * @param arg Unused
+ */
+static void drain_handler(void *arg)
+{
+	struct mcevent qv[EVENT_QSIZE];
+	size_t qn;
+	size_t i;
+	(void)arg;
+
+	mtx_lock(evq.mtx);
+	qn = evq.qn;
+	memcpy(qv, evq.qv, qn * sizeof(*qv));
+	evq.qn = 0;
+	evq.scheduled = false;
+	evq.emitted += qn;
+	mtx_unlock(evq.mtx);
+
+	evq.last = tmr_jiffies();
+
+	for (i = 0; i < qn; i++) {
+		const struct mcevent *ev = &qv[i];
+
+		if (eventv[ev->type].log) {
+			info("multicast receiver: %s addr=%J prio=%d "
+				"enabled=%d state=%s count=%u\n",
+				eventv[ev->type].log, &ev->addr, ev->prio,
+				ev->enable, ev->state, ev->count);
+		}
+
+		if (ev->count > 1) {
+			module_event("multicast", eventv[ev->type].name, NULL,
+				NULL, "addr=%J prio=%d enabled=%d state=%s "
+				"count=%u", &ev->addr, ev->prio, ev->enable,
+				ev->state, ev->count);
+		}
+		else {
+			module_event("multicast", eventv[ev->type].name, NULL,
+				NULL, "addr=%J prio=%d enabled=%d state=%s",
+				&ev->addr, ev->prio, ev->enable, ev->state);
+		}
+	}
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	uint64_t now = tmr_jiffies();
+	(void)id;
+	(void)data;
+	(void)arg;
+
+	if (now - evq.last >= EVENT_INTERVAL)
+		drain_handler(NULL);
+	else
+		tmr_start(&evq.tmr, EVENT_INTERVAL - (now - evq.last),
+			drain_handler, NULL);
+}
+
+
+/**
+ * Queue a receiver event
+ *
+ * If the latest pending event of the address has the same type and state,
+ * it is updated instead of queueing a new one. Events are emitted from the
+ * main thread at most every EVENT_INTERVAL ms.
+ *
+ * @param type   Event type
+ * @param addr   Receiver address
+ * @param prio   Receiver priority
+ * @param enable Receiver enable flag
+ * @param state  Receiver state string (static)
+ */
+void mcevent_emit(enum mcevent_type type, const struct sa *addr,
+	uint8_t prio, bool enable, const char *state)
+{
+	struct mcevent *ev = NULL;
+	size_t i;
+
+	if (!evq.mtx || type >= MCEVENT_MAX || !addr)
+		return;
+
+	mtx_lock(evq.mtx);
+
+	/* merge only with the latest record of this address, keep the order */
+	for (i = evq.qn; i > 0; i--) {
+		struct mcevent *last = &evq.qv[i - 1];
+
+		if (!sa_cmp(&last->addr, addr, SA_ALL))
+			continue;
+
+		/* the state string is static, distinct transitions are kept */
+		if (last->type == type && last->state == state) {
+			ev = last;
+			++evq.coalesced;
+		}
+
+		break;
+	}
+
+	if (!ev) {
+		if (evq.qn == EVENT_QSIZE) {
+			++evq.dropped;
+			goto out;
+		}
+
+		ev = &evq.qv[evq.qn++];
+		ev->type  = type;
+		ev->count = 0;
+		sa_cpy(&ev->addr, addr);
+	}
+
+	ev->prio   = prio;
+	ev->enable = enable;
+	ev->state  = state;
+	++ev->count;
+
+	if (!evq.scheduled) {
+		evq.scheduled = true;
+		(void)mqueue_push(evq.mq, 0, NULL);
+	}
+
+  out:
+	mtx_unlock(evq.mtx);
+}
+
+
+/**
+ * Print the event queue statistics
+ *
+ * @param pf Printer
+ */
+void mcevent_print(struct re_printf *pf)
+{
+	if (!evq.mtx)
+		return;
+
+	mtx_lock(evq.mtx);
+	re_hprintf(pf, "Multicast Events: emitted=%llu coalesced=%llu "
+		"dropped=%llu pending=%zu\n", evq.emitted, evq.coalesced,
+		evq.dropped, evq.qn);
+	mtx_unlock(evq.mtx);
+}
+
+
+/**
+ * Initialize the event queue
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcevent_init(void)
+{
+	int err;
+
+	memset(&evq, 0, sizeof(evq));
+	tmr_init(&evq.tmr);
+
+	err  = mutex_alloc(&evq.mtx);
+	err |= mqueue_alloc(&evq.mq, mqueue_handler, NULL);
+	if (err) {
+		evq.mtx = mem_deref(evq.mtx);
+		evq.mq  = mem_deref(evq.mq);
+	}
+
+	return err;
+}
+
+
+/**
+ * Emit the pending events and terminate the event queue
+ */
+void mcevent_terminate(void)
+{
+	if (!evq.mtx)
+		return;
+
+	tmr_cancel(&evq.tmr);
+	drain_handler(NULL);
+
+	evq.mq  = mem_deref(evq.mq);
+	evq.mtx = mem_deref(evq.mtx);
+}
@@ -1,11 +1,13 @@
 /**
  * @file multicast.c
  *
- * @note supported codecs are PCMU, PCMA, G722
+ * @note supported codecs are PCMU, PCMA, G722 and for video the video codecs
+ *       with an encoder/decoder (e.g. H264)
  *
  * Copyright (C) 2021 Commend.com - c.huber@commend.com
  */
 
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 
@@ -20,12 +22,26 @@ struct mccfg {
 	uint32_t callprio;
 	uint32_t ttl;
 	uint32_t tfade;
+	uint32_t tidle;
+	uint32_t cpu_budget;
+	uint32_t bitrate;
+	bool vad;
+	int32_t vad_thres;
+	uint32_t vad_hangover;
+	uint32_t vid_keyint;
 };
 
 static struct mccfg mccfg = {
 	0,
 	1,
 	125,
+	5000,
+	0,
+	0,
+	false,
+	-50,
+	500,
+	2000,
 };
 
 
@@ -87,6 +103,42 @@ static int decode_codec(struct pl *plcodec, struct aucodec **codecptr)
 }
 
 
+/**
+ * Decode videocodec <CODEC>
+ *
+ * @param plcodec Parameter string
+ * @param vcp     Video codec ptr
+ * @param enc     True to search an encoder, false for a decoder
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int decode_vidcodec(struct pl *plcodec, const struct vidcodec **vcp,
+	bool enc)
+{
+	const struct vidcodec *vc = NULL;
+	char *name = NULL;
+	int err;
+
+	err = pl_strdup(&name, plcodec);
+	if (err)
+		return err;
+
+	if (enc)
+		vc = vidcodec_find_encoder(baresip_vidcodecl(), name);
+	else
+		vc = vidcodec_find_decoder(baresip_vidcodecl(), name);
+
+	if (!vc) {
+		err = EINVAL;
+		warning ("multicast: video codec not found (%r)\n", plcodec);
+	}
+
+	mem_deref(name);
+	*vcp = vc;
+	return err;
+}
+
+
 /**
  * Check audio encoder RTP payload type
  *
@@ -136,6 +188,84 @@ uint32_t multicast_fade_time(void)
 }
 
 
+/**
+ * Getter for configurable idle time after which the jitter buffer of a
+ * silent multicast receiver is released
+ *
+ * @return uint32_t multicast receiver idle time in [ms]
+ */
+uint32_t multicast_rx_idle_time(void)
+{
+	return mccfg.tidle;
+}
+
+
+/**
+ * Getter for the configurable CPU budget of the source encoder
+ *
+ * @return uint32_t encode time in [%] of the packet time, 0 if disabled
+ */
+uint32_t multicast_cpu_budget(void)
+{
+	return mccfg.cpu_budget;
+}
+
+
+/**
+ * Getter for the configurable source encoder bitrate
+ *
+ * @return uint32_t bitrate in [bit/s], 0 for the codec default
+ */
+uint32_t multicast_bitrate(void)
+{
+	return mccfg.bitrate;
+}
+
+
+/**
+ * Getter for the source voice activity gate
+ *
+ * @return bool true if silence is not transmitted
+ */
+bool multicast_vad(void)
+{
+	return mccfg.vad;
+}
+
+
+/**
+ * Getter for the voice activity threshold
+ *
+ * @return int32_t audio level threshold in [dBov]
+ */
+int32_t multicast_vad_threshold(void)
+{
+	return mccfg.vad_thres;
+}
+
+
+/**
+ * Getter for the voice activity hangover time
+ *
+ * @return uint32_t hangover time in [ms]
+ */
+uint32_t multicast_vad_hangover(void)
+{
+	return mccfg.vad_hangover;
+}
+
+
+/**
+ * Getter for the forced video key-frame interval
+ *
+ * @return uint32_t key-frame interval in [ms], 0 to disable
+ */
+uint32_t multicast_vid_keyint(void)
+{
+	return mccfg.vid_keyint;
+}
+
+
 /**
  * Create a new multicast sender
  *
@@ -177,6 +307,43 @@ static int cmd_mcsend(struct re_printf *pf, void *arg)
 }
 
 
+/**
+ * Create a new multicast video sender
+ *
+ * @param pf  Printer
+ * @param arg Command arguments
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_mcvidsend(struct re_printf *pf, void *arg)
+{
+	int err = 0;
+	const struct cmd_arg *carg = arg;
+	struct pl pladdr, plcodec;
+	struct sa addr;
+	const struct vidcodec *vc = NULL;
+
+	err = re_regex(carg->prm, str_len(carg->prm),
+		"addr=[^ ]* codec=[^ ]*", &pladdr, &plcodec);
+	if (err)
+		goto out;
+
+	err = decode_addr(&pladdr, &addr);
+	err |= decode_vidcodec(&plcodec, &vc, true);
+	if (err)
+		goto out;
+
+	err = mcsender_vidalloc(&addr, vc);
+
+  out:
+	if (err)
+		re_hprintf(pf,
+			"usage: /mcvidsend addr=<IP>:<PORT> codec=<CODEC>\n");
+
+	return err;
+}
+
+
 /**
  * Enable / Disable all multicast sender without removing it
  *
@@ -275,11 +442,70 @@ static int cmd_mcinfo(struct re_printf *pf, void *arg)
 
 	mcsender_print(pf);
 	mcreceiver_print(pf);
+	mcplayer_print(pf);
+	mcthread_print(pf);
+	mcevent_print(pf);
 
 	return 0;
 }
 
 
+/**
+ * Start a loopback benchmark with synthetic multicast streams
+ *
+ * @param pf  Printer
+ * @param arg Command arguments
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_mcbench(struct re_printf *pf, void *arg)
+{
+	int err = 0;
+	const struct cmd_arg *carg = arg;
+	struct pl pladdr, plstreams, plcodec, pl;
+	struct aucodec *ac = NULL;
+	struct mcbench_prm prm;
+
+	memset(&prm, 0, sizeof(prm));
+	prm.ptime    = PTIME;
+	prm.duration = 10;
+	str_ncpy(prm.csv, "mcbench.csv", sizeof(prm.csv));
+
+	err = re_regex(carg->prm, str_len(carg->prm),
+		"addr=[^ ]* streams=[0-9]+ codec=[^ ]*",
+		&pladdr, &plstreams, &plcodec);
+	if (err)
+		goto out;
+
+	err  = decode_addr(&pladdr, &prm.addr);
+	err |= decode_codec(&plcodec, &ac);
+	if (err)
+		goto out;
+
+	prm.ac      = ac;
+	prm.streams = pl_u32(&plstreams);
+
+	if (!re_regex(carg->prm, str_len(carg->prm), "ptime=[0-9]+", &pl))
+		prm.ptime = pl_u32(&pl);
+	if (!re_regex(carg->prm, str_len(carg->prm), "loss=[0-9]+", &pl))
+		prm.loss = pl_u32(&pl);
+	if (!re_regex(carg->prm, str_len(carg->prm), "time=[0-9]+", &pl))
+		prm.duration = pl_u32(&pl);
+	if (!re_regex(carg->prm, str_len(carg->prm), "csv=[^ ]+", &pl))
+		(void)pl_strcpy(&pl, prm.csv, sizeof(prm.csv));
+
+	err = mcbench_start(&prm);
+
+  out:
+	if (err)
+		re_hprintf(pf, "usage: /mcbench addr=<IP>:<PORT> streams=<N> "
+			"codec=<CODEC> [ptime=<MS>] [loss=<PERCENT>] "
+			"[time=<SEC>] [csv=<FILE>]\n");
+
+	return err;
+}
+
+
 /**
  * Create a new multicast listener with prio
  *
@@ -309,7 +535,7 @@ static int cmd_mcreg(struct re_printf *pf, void *arg)
 		goto out;
 	}
 
-	err = mcreceiver_alloc(&addr, prio);
+	err = mcreceiver_alloc(&addr, prio, NULL);
 
   out:
 	if (err)
@@ -320,6 +546,49 @@ static int cmd_mcreg(struct re_printf *pf, void *arg)
 }
 
 
+/**
+ * Create a new multicast video listener with prio
+ *
+ * @param pf  Printer
+ * @param arg Command arguments
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_mcvidreg(struct re_printf *pf, void *arg)
+{
+	int err = 0;
+	const struct cmd_arg *carg = arg;
+	struct pl pladdr, plprio, plcodec;
+	const struct vidcodec *vc = NULL;
+	struct sa addr;
+	uint32_t prio;
+
+	err = re_regex(carg->prm, str_len(carg->prm),
+		"addr=[^ ]* prio=[^ ]* codec=[^ ]*",
+		&pladdr, &plprio, &plcodec);
+	if (err)
+		goto out;
+
+	prio = pl_u32(&plprio);
+	err = decode_addr(&pladdr, &addr);
+	err |= decode_vidcodec(&plcodec, &vc, false);
+	if (err || !prio) {
+		if (!prio)
+			err = EINVAL;
+		goto out;
+	}
+
+	err = mcreceiver_alloc(&addr, prio, vc);
+
+  out:
+	if (err)
+		re_hprintf(pf, "usage: /mcvidreg addr=<IP>:<PORT> "
+			   "prio=<1-255> codec=<CODEC>\n");
+
+	return err;
+}
+
+
 /**
  * Un-register a multicast listener
  *
@@ -645,6 +914,24 @@ static int module_read_config(void)
 	if (mccfg.tfade > 2000)
 		mccfg.tfade = 2000;
 
+	(void)conf_get_u32(conf_cur(), "multicast_rx_idle_time",
+		&mccfg.tidle);
+
+	(void)conf_get_u32(conf_cur(), "multicast_cpu_budget",
+		&mccfg.cpu_budget);
+	if (mccfg.cpu_budget > 100)
+		mccfg.cpu_budget = 100;
+
+	(void)conf_get_u32(conf_cur(), "multicast_bitrate", &mccfg.bitrate);
+
+	(void)conf_get_bool(conf_cur(), "multicast_vad", &mccfg.vad);
+	(void)conf_get_i32(conf_cur(), "multicast_vad_threshold",
+		&mccfg.vad_thres);
+	(void)conf_get_u32(conf_cur(), "multicast_vad_hangover",
+		&mccfg.vad_hangover);
+	(void)conf_get_u32(conf_cur(), "multicast_vid_keyint",
+		&mccfg.vid_keyint);
+
 	sa_init(&laddr, AF_INET);
 	err = conf_apply(conf_cur(), "multicast_listener",
 		module_read_config_handler, &prio);
@@ -657,13 +944,17 @@ static int module_read_config(void)
 
 static const struct cmd cmdv[] = {
 	{"mcinfo",    0, CMD_PRM, "Show multicast information", cmd_mcinfo   },
+	{"mcbench",   0, CMD_PRM, "Multicast loopback benchmark", cmd_mcbench},
 
 	{"mcsend",    0, CMD_PRM, "Send multicast"            , cmd_mcsend   },
 	{"mcstop",    0, CMD_PRM, "Stop multicast"            , cmd_mcstop   },
 	{"mcstopall", 0, CMD_PRM, "Stop all multicast"        , cmd_mcstopall},
 	{"mcsenden",  0, CMD_PRM, "Enable/Disable all sender" , cmd_mcsenden },
+	{"mcvidsend", 0, CMD_PRM, "Send video multicast"      , cmd_mcvidsend},
 
 	{"mcreg",     0, CMD_PRM, "Reg. multicast listener"   , cmd_mcreg    },
+	{"mcvidreg",  0, CMD_PRM, "Reg. video multicast listener",
+		cmd_mcvidreg},
 	{"mcunreg",   0, CMD_PRM, "Unreg. multicast listener" , cmd_mcunreg  },
 	{"mcunregall",0, CMD_PRM, "Unreg. all multicast listener",
 		cmd_mcunregall},
@@ -681,11 +972,16 @@ static int module_init(void)
 {
 	int err = 0;
 
-	err = module_read_config();
+	/* the player zones are needed by the configured listener */
+	err = mcthread_init();
+	err |= mcevent_init();
+	err |= mcplayer_init();
+	err |= module_read_config();
 	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 
 	err |= mcsource_init();
-	err |= mcplayer_init();
+	err |= mcvidsource_init();
+	err |= mcvidplayer_init();
 
 	if (!err)
 		info("multicast: module init\n");
@@ -696,6 +992,7 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	mcbench_terminate();
 	mcsender_stopall();
 	mcreceiver_unregall();
 
@@ -703,6 +1000,10 @@ static int module_close(void)
 
 	mcsource_terminate();
 	mcplayer_terminate();
+	mcvidsource_terminate();
+	mcvidplayer_terminate();
+	mcthread_terminate();
+	mcevent_terminate();
 
 	return 0;
 }
@@ -15,19 +15,81 @@ enum {
 
 	AUDIO_SAMPSZ	= MAX_SRATE * MAX_CHANNELS * MAX_PTIME / 1000,
 	PTIME		= 20,
+
+	VIDEO_PKTSIZE	= 1280,               /* Max. video RTP payload size */
+	VIDEO_PT	= 96,                 /* Dynamic video payload type  */
+	PT_CN		= 13,                 /* Comfort noise payload type  */
+	DTX_KEEPALIVE	= 400,                /* CN interval in DTX in [ms]  */
 };
 
 
 uint8_t multicast_callprio(void);
 uint8_t multicast_ttl(void);
 uint32_t multicast_fade_time(void);
+uint32_t multicast_rx_idle_time(void);
+uint32_t multicast_cpu_budget(void);
+uint32_t multicast_bitrate(void);
+bool multicast_vad(void);
+int32_t multicast_vad_threshold(void);
+uint32_t multicast_vad_hangover(void);
+uint32_t multicast_vid_keyint(void);
+
+
+/* Benchmark */
+struct mcbench_prm {
+	struct sa addr;
+	const struct aucodec *ac;
+	uint32_t streams;
+	uint32_t ptime;
+	uint32_t loss;
+	uint32_t duration;
+	char csv[256];
+};
+
+int  mcbench_start(const struct mcbench_prm *prm);
+void mcbench_rtp(const struct sa *addr, const struct rtp_header *hdr,
+	bool running);
+void mcbench_terminate(void);
+
+
+/* Event */
+enum mcevent_type {
+	MCEVENT_START,
+	MCEVENT_RESTART,
+	MCEVENT_STOP,
+	MCEVENT_EOS,
+
+	MCEVENT_MAX
+};
+
+void mcevent_emit(enum mcevent_type type, const struct sa *addr,
+	uint8_t prio, bool enable, const char *state);
+void mcevent_print(struct re_printf *pf);
+int  mcevent_init(void);
+void mcevent_terminate(void);
+
+
+/* Thread */
+enum mcthread_type {
+	MCTHREAD_TX,
+	MCTHREAD_DECODE,
+
+	MCTHREAD_MAX
+};
+
+int  mcthread_apply(enum mcthread_type type);
+void mcthread_latency(enum mcthread_type type, uint64_t usec);
+void mcthread_print(struct re_printf *pf);
+int  mcthread_init(void);
+void mcthread_terminate(void);
 
 
 /* Sender */
-typedef int (mcsender_send_h)(size_t ext_len, bool marker, uint32_t rtp_ts,
-	struct mbuf *mb, void *arg);
+typedef int (mcsender_send_h)(size_t ext_len, bool marker, bool cn,
+	uint32_t rtp_ts, struct mbuf *mb, void *arg);
 
 int  mcsender_alloc(struct sa *addr, const struct aucodec *codec);
+int  mcsender_vidalloc(struct sa *addr, const struct vidcodec *vc);
 void mcsender_stopall(void);
 void mcsender_stop(struct sa *addr);
 void mcsender_enable(bool enable);
@@ -35,7 +97,8 @@ void mcsender_enable(bool enable);
 void mcsender_print(struct re_printf *pf);
 
 /* Receiver */
-int mcreceiver_alloc(struct sa *addr, uint8_t prio);
+int mcreceiver_alloc(struct sa *addr, uint8_t prio,
+	const struct vidcodec *vc);
 void mcreceiver_unregall(void);
 void mcreceiver_unreg(struct sa *addr);
 int mcreceiver_chprio(struct sa *addr, uint32_t prio);
@@ -48,16 +111,29 @@ void mcreceiver_enable(bool enable);
 void mcreceiver_print(struct re_printf *pf);
 
 /* Player <exchangable player> */
-int mcplayer_start(const struct aucodec *ac);
-void mcplayer_stop(void);
-void mcplayer_fadeout(void);
-void mcplayer_fadein(bool restart);
-bool mcplayer_fadeout_done(void);
-int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop);
+struct mczone;
+struct mczone *mcplayer_zone(uint32_t prio);
+int mcplayer_start(struct mczone *zone, const struct aucodec *ac,
+	struct jbuf *jbuf);
+void mcplayer_stop(struct mczone *zone);
+void mcplayer_fadeout(struct mczone *zone);
+void mcplayer_fadein(struct mczone *zone, bool restart);
+bool mcplayer_fadeout_done(struct mczone *zone);
+void mcplayer_decode(struct mczone *zone);
+
+void mcplayer_print(struct re_printf *pf);
 
 int  mcplayer_init(void);
 void mcplayer_terminate(void);
 
+/* Video player */
+int  mcvidplayer_start(const struct vidcodec *vc);
+void mcvidplayer_stop(void);
+int  mcvidplayer_decode(const struct rtp_header *hdr, struct mbuf *mb);
+
+int  mcvidplayer_init(void);
+void mcvidplayer_terminate(void);
+
 /* Source <exchangable source> */
 struct mcsource;
 int mcsource_start(struct mcsource **srcp, const struct aucodec *ac,
@@ -66,3 +142,11 @@ void mcsource_stop(struct mcsource *src);
 
 int  mcsource_init(void);
 void mcsource_terminate(void);
+
+/* Video source */
+struct mcvidsource;
+int mcvidsource_start(struct mcvidsource **srcp, const struct vidcodec *vc,
+	mcsender_send_h *sendh, void *arg);
+
+int  mcvidsource_init(void);
+void mcvidsource_terminate(void);
@@ -4,6 +4,7 @@
  * Copyright (C) 2021 Commend.com - c.huber@commend.com
  */
 
+#include <re_atomic.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -56,12 +57,39 @@ struct mcplayer {
 };
 
 
-static struct mcplayer *player;
+/**
+ * Multicast player zone
+ *
+ * An output device with a priority range. Each zone plays at most one
+ * multicast at a time and decodes it in its own thread.
+ */
+struct mczone {
+	struct le le;
+	char *module;
+	char *device;
+	uint32_t priol;
+	uint32_t prioh;
+
+	struct mcplayer *player;
+	struct jbuf *jbuf;
+	mtx_t *mtx;
+	cnd_t cnd;
+	uint32_t pending;
+	uint64_t ts_signal;
+
+	struct {
+		thrd_t tid;
+		RE_ATOMIC bool run;
+	} thr;
+};
+
+
+static struct list zonel = LIST_INIT;
 
 
 static void mcplayer_destructor(void *arg)
 {
-	(void) arg;
+	struct mcplayer *player = arg;
 
 	mem_deref(player->auplay);
 
@@ -75,7 +103,7 @@ static void mcplayer_destructor(void *arg)
 }
 
 
-static void fade_process(struct auframe *af)
+static void fade_process(struct mcplayer *player, struct auframe *af)
 {
 	size_t i;
 	int16_t *sampv_ptr = af->sampv;
@@ -142,13 +170,15 @@ static void fade_process(struct auframe *af)
 /**
  * Decode the payload of the RTP packet
  *
- * @param hdr   RTP header
- * @param mb    RTP payload
- * @param drop  True if the jbuf returned EAGAIN
+ * @param player Multicast player
+ * @param hdr    RTP header
+ * @param mb     RTP payload
+ * @param drop   True if the jbuf returned EAGAIN
  *
  * @return 0 if success, otherwise errorcode
  */
-int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
+static int player_decode_frame(struct mcplayer *player,
+	const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 {
 	struct auframe af;
 	struct le *le;
@@ -225,7 +255,7 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 		goto out;
 	}
 
-	fade_process(&af);
+	fade_process(player, &af);
 	err = aubuf_write_auframe(player->aubuf, &af);
 
   out:
@@ -234,18 +264,84 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 }
 
 
+/**
+ * Decode the next RTP packet of the zone jitter buffer
+ *
+ * @param zone Multicast player zone
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int player_decode(struct mczone *zone)
+{
+	void *mb = NULL;
+	struct rtp_header hdr;
+	int jerr;
+	int err;
+
+	jerr = jbuf_get(zone->jbuf, &hdr, &mb);
+	if (jerr && jerr != EAGAIN)
+		return jerr;
+
+	err = player_decode_frame(zone->player, &hdr, mb, jerr == EAGAIN);
+	mb = mem_deref(mb);
+	if (err)
+		return err;
+
+	return jerr;
+}
+
+
+/**
+ * Zone decode thread
+ *
+ * Decodes one packet of the jitter buffer for each packet signaled by
+ * mcplayer_decode()
+ *
+ * @param arg Multicast player zone
+ *
+ * @return 0
+ */
+static int decode_thread(void *arg)
+{
+	struct mczone *zone = arg;
+
+	(void)mcthread_apply(MCTHREAD_DECODE);
+
+	mtx_lock(zone->mtx);
+	while (re_atomic_rlx(&zone->thr.run)) {
+		if (!zone->pending) {
+			cnd_wait(&zone->cnd, zone->mtx);
+			continue;
+		}
+
+		if (zone->ts_signal) {
+			mcthread_latency(MCTHREAD_DECODE,
+				tmr_jiffies_usec() - zone->ts_signal);
+			zone->ts_signal = 0;
+		}
+
+		--zone->pending;
+		if (!zone->player || !zone->jbuf)
+			continue;
+
+		if (player_decode(zone) == EAGAIN)
+			(void) player_decode(zone);
+	}
+	mtx_unlock(zone->mtx);
+
+	return 0;
+}
+
+
 /**
  * Audio player write handler
  *
  * @param af   Audio frame (af.sampv, af.sampc and af.fmt needed)
- * @param arg  unused
+ * @param arg  Multicast player
  */
 static void auplay_write_handler(struct auframe *af, void *arg)
 {
-	(void) arg;
-
-	if (!player)
-		return;
+	struct mcplayer *player = arg;
 
 	aubuf_read_auframe(player->aubuf, af);
 }
@@ -254,11 +350,12 @@ static void auplay_write_handler(struct auframe *af, void *arg)
 /**
  * Setup all available audio filter for the decoder
  *
+ * @param player  Multicast player
  * @param aufiltl List of audio filter
  *
  * @return 0 if success, otherwise errorcode
  */
-static int aufilt_setup(struct list *aufiltl)
+static int aufilt_setup(struct mcplayer *player, struct list *aufiltl)
 {
 	struct aufilt_prm prm;
 	struct le *le;
@@ -305,30 +402,24 @@ static int aufilt_setup(struct list *aufiltl)
 
 
 /**
- * Allocate and start a media player for the multicast
- *
- * @note singleton
+ * Allocate a media player for the multicast
  *
- * @param ac   Audio codec
+ * @param playerp Multicast player ptr
+ * @param zone    Multicast player zone
+ * @param ac      Audio codec
  *
  * @return 0 if success, otherwise errorcode
  */
-int mcplayer_start(const struct aucodec *ac)
+static int mcplayer_alloc(struct mcplayer **playerp, struct mczone *zone,
+	const struct aucodec *ac)
 {
 	int err = 0;
 	struct config_audio *cfg = &conf_config()->audio;
+	struct mcplayer *player;
 	uint32_t srate_dsp;
 	uint32_t channels_dsp;
 	struct auplay_prm prm;
 
-	if (!ac)
-		return EINVAL;
-
-	if (player &&
-		(player->fades == FM_FADEOUT || player->fades == FM_FADEIN))
-		return EINPROGRESS;
-
-	player = mem_deref(player);
 	player = mem_zalloc(sizeof(*player), mcplayer_destructor);
 	if (!player)
 		return ENOMEM;
@@ -338,8 +429,8 @@ int mcplayer_start(const struct aucodec *ac)
 	player->play_fmt = cfg->play_fmt;
 	player->dec_fmt = cfg->dec_fmt;
 
-	err = str_dup(&player->module, cfg->play_mod);
-	err |= str_dup(&player->device, cfg->play_dev);
+	err = str_dup(&player->module, zone->module);
+	err |= str_dup(&player->device, zone->device);
 	if (err)
 		goto out;
 
@@ -403,7 +494,7 @@ int mcplayer_start(const struct aucodec *ac)
 		aubuf_set_silence(player->aubuf, cfg->silence);
 	}
 
-	err = aufilt_setup(baresip_aufiltl());
+	err = aufilt_setup(player, baresip_aufiltl());
 	if (err)
 	{
 		warning("multicast player: aufilt setup error (%m)\n)", err);
@@ -422,67 +513,317 @@ int mcplayer_start(const struct aucodec *ac)
 
   out:
 	if (err)
-		player = mem_deref(player);
+		mem_deref(player);
+	else
+		*playerp = player;
 
 	return err;
 }
 
 
 /**
- * Stop multicast player
+ * Allocate and start a media player for the multicast in the given zone
+ *
+ * @param zone Multicast player zone
+ * @param ac   Audio codec
+ * @param jbuf Jitter buffer of the multicast receiver
+ *
+ * @return 0 if success, otherwise errorcode
  */
-void mcplayer_stop(void)
+int mcplayer_start(struct mczone *zone, const struct aucodec *ac,
+	struct jbuf *jbuf)
 {
-	player = mem_deref(player);
+	struct mcplayer *player = NULL;
+	int err = 0;
+
+	if (!zone || !ac || !jbuf)
+		return EINVAL;
+
+	mtx_lock(zone->mtx);
+	if (zone->player && (zone->player->fades == FM_FADEOUT ||
+		zone->player->fades == FM_FADEIN)) {
+		err = EINPROGRESS;
+		goto out;
+	}
+
+	zone->player = mem_deref(zone->player);
+	zone->jbuf = mem_deref(zone->jbuf);
+	zone->pending = 0;
+
+	err = mcplayer_alloc(&player, zone, ac);
+	if (err)
+		goto out;
+
+	zone->player = player;
+	zone->jbuf = mem_ref(jbuf);
+
+  out:
+	mtx_unlock(zone->mtx);
+	return err;
 }
 
 
 /**
- * Fade-out active player
+ * Stop multicast player of a zone
  *
+ * @param zone Multicast player zone
  */
-void mcplayer_fadeout(void)
+void mcplayer_stop(struct mczone *zone)
 {
-	if (!player)
+	if (!zone)
 		return;
 
-	if (player->fades == FM_FADEOUT || player->fades == FM_FADEOUTDONE)
+	mtx_lock(zone->mtx);
+	zone->player = mem_deref(zone->player);
+	zone->jbuf = mem_deref(zone->jbuf);
+	zone->pending = 0;
+	mtx_unlock(zone->mtx);
+}
+
+
+/**
+ * Signal the zone decode thread that a new RTP packet was put into the
+ * jitter buffer
+ *
+ * @param zone Multicast player zone
+ */
+void mcplayer_decode(struct mczone *zone)
+{
+	if (!zone)
 		return;
 
-	player->fades = FM_FADEOUT;
+	mtx_lock(zone->mtx);
+	if (zone->player) {
+		++zone->pending;
+		if (!zone->ts_signal)
+			zone->ts_signal = tmr_jiffies_usec();
+
+		cnd_signal(&zone->cnd);
+	}
+	mtx_unlock(zone->mtx);
 }
 
 
 /**
+ * Fade-out active player
+ *
+ * @param zone Multicast player zone
+ */
+void mcplayer_fadeout(struct mczone *zone)
+{
+	if (!zone)
+		return;
+
+	mtx_lock(zone->mtx);
+	if (zone->player && zone->player->fades != FM_FADEOUT &&
+		zone->player->fades != FM_FADEOUTDONE)
+		zone->player->fades = FM_FADEOUT;
+	mtx_unlock(zone->mtx);
+}
+
+
+/**
+ * @param zone Multicast player zone
+ *
  * @return True if the fade-out finished
  */
-bool mcplayer_fadeout_done(void)
+bool mcplayer_fadeout_done(struct mczone *zone)
 {
-	if (!player)
+	bool done;
+
+	if (!zone)
 		return false;
 
-	return player->fades == FM_FADEOUTDONE;
+	mtx_lock(zone->mtx);
+	done = zone->player && zone->player->fades == FM_FADEOUTDONE;
+	mtx_unlock(zone->mtx);
+
+	return done;
 }
 
 
 /**
  * Fade-in active player
  *
+ * @param zone     Multicast player zone
  * @param restart  If true the fade-in restarts with silence level
  */
-void mcplayer_fadein(bool restart)
+void mcplayer_fadein(struct mczone *zone, bool restart)
 {
-	if (!player)
+	if (!zone)
 		return;
 
+	mtx_lock(zone->mtx);
+	if (!zone->player)
+		goto out;
+
 	if (restart)
-		player->fade_c = 0;
-	else if (player->fades == FM_FADEINDONE)
-		return;
+		zone->player->fade_c = 0;
+	else if (zone->player->fades == FM_FADEINDONE)
+		goto out;
+
+	zone->player->fades = FM_FADEIN;
+
+  out:
+	mtx_unlock(zone->mtx);
+}
+
+
+/**
+ * Find the player zone of a priority
+ *
+ * @param prio Priority
+ *
+ * @return Multicast player zone, NULL if no zone covers the priority
+ */
+struct mczone *mcplayer_zone(uint32_t prio)
+{
+	struct le *le;
+
+	LIST_FOREACH(&zonel, le) {
+		struct mczone *zone = le->data;
+
+		if (prio >= zone->priol && prio <= zone->prioh)
+			return zone;
+	}
+
+	return NULL;
+}
 
-	player->fades = FM_FADEIN;
+
+/**
+ * Print all multicast player zones
+ *
+ * @param pf Printer
+ */
+void mcplayer_print(struct re_printf *pf)
+{
+	struct le *le;
+
+	re_hprintf(pf, "Multicast Player Zones:\n");
+	LIST_FOREACH(&zonel, le) {
+		struct mczone *zone = le->data;
+
+		mtx_lock(zone->mtx);
+		re_hprintf(pf, "   %s,%s prio=%u-%u %s\n",
+			zone->module, zone->device, zone->priol, zone->prioh,
+			zone->player ? zone->player->ac->name : "idle");
+		mtx_unlock(zone->mtx);
+	}
 }
 
+
+static void mczone_destructor(void *arg)
+{
+	struct mczone *zone = arg;
+
+	if (re_atomic_rlx(&zone->thr.run)) {
+		mtx_lock(zone->mtx);
+		re_atomic_rlx_set(&zone->thr.run, false);
+		cnd_signal(&zone->cnd);
+		mtx_unlock(zone->mtx);
+		thrd_join(zone->thr.tid, NULL);
+	}
+
+	list_unlink(&zone->le);
+	zone->player = mem_deref(zone->player);
+	zone->jbuf   = mem_deref(zone->jbuf);
+	cnd_destroy(&zone->cnd);
+	zone->mtx    = mem_deref(zone->mtx);
+	zone->module = mem_deref(zone->module);
+	zone->device = mem_deref(zone->device);
+}
+
+
+/**
+ * Allocate a player zone and start its decode thread
+ *
+ * @param module Audio player module
+ * @param device Audio player device
+ * @param priol  Lower priority boundary
+ * @param prioh  Higher priority boundary
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mczone_alloc(const struct pl *module, const struct pl *device,
+	uint32_t priol, uint32_t prioh)
+{
+	struct mczone *zone;
+	int err;
+
+	zone = mem_zalloc(sizeof(*zone), mczone_destructor);
+	if (!zone)
+		return ENOMEM;
+
+	zone->priol = priol;
+	zone->prioh = prioh;
+
+	err  = pl_strdup(&zone->module, module);
+	err |= pl_strdup(&zone->device, device);
+	err |= mutex_alloc(&zone->mtx);
+	if (err)
+		goto out;
+
+	if (cnd_init(&zone->cnd) != thrd_success) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	re_atomic_rlx_set(&zone->thr.run, true);
+	err = thread_create_name(&zone->thr.tid, "mcplayer", decode_thread,
+		zone);
+	if (err) {
+		re_atomic_rlx_set(&zone->thr.run, false);
+		goto out;
+	}
+
+	list_append(&zonel, &zone->le, zone);
+	info("multicast player: zone %s,%s prio=%u-%u\n",
+		zone->module, zone->device, priol, prioh);
+
+  out:
+	if (err)
+		mem_deref(zone);
+
+	return err;
+}
+
+
+/**
+ * Config handler for a player zone line
+ *
+ * @param pl  <MODULE>,<DEVICE> <PRIOL>-<PRIOH>
+ * @param arg Unused
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int zone_config_handler(const struct pl *pl, void *arg)
+{
+	struct pl module, device, priol, prioh;
+	uint32_t lo, hi;
+	int err;
+	(void) arg;
+
+	err = re_regex(pl->p, pl->l, "[^,]+,[^ ]+ [0-9]+-[0-9]+",
+		&module, &device, &priol, &prioh);
+	if (err) {
+		warning("multicast player: invalid zone '%r'\n", pl);
+		return err;
+	}
+
+	/* a zone that can never match is a configuration error */
+	lo = pl_u32(&priol);
+	hi = pl_u32(&prioh);
+	if (!lo || lo > hi || hi > 255) {
+		warning("multicast player: invalid priority range %u-%u of "
+			"zone '%r' (1-255)\n", lo, hi, pl);
+		return EINVAL;
+	}
+
+	return mczone_alloc(&module, &device, lo, hi);
+}
+
+
 /**
  * Initialize everything needed for the player beforhand
  *
@@ -490,7 +831,19 @@ void mcplayer_fadein(bool restart)
  */
 int mcplayer_init(void)
 {
-	return 0;
+	struct config_audio *cfg = &conf_config()->audio;
+	struct pl module, device;
+	int err;
+
+	err = conf_apply(conf_cur(), "multicast_zone", zone_config_handler,
+		NULL);
+	if (err || !list_isempty(&zonel))
+		return err;
+
+	pl_set_str(&module, cfg->play_mod);
+	pl_set_str(&device, cfg->play_dev);
+
+	return mczone_alloc(&module, &device, 1, 255);
 }
 
 /**
@@ -499,5 +852,5 @@ int mcplayer_init(void)
  */
 void mcplayer_terminate(void)
 {
-	return;
+	list_flush(&zonel);
 }
@@ -4,6 +4,14 @@
  * Copyright (C) 2021 Commend.com - c.huber@commend.com
  */
 
+#ifdef LINUX
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <re_atomic.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -17,10 +25,13 @@
 
 struct list mcreceivl = LIST_INIT;
 static mtx_t mcreceivl_lock;
+static RE_ATOMIC uint32_t prio_gen = 1;
 
 
 enum {
 	TIMEOUT = 1000,
+	WATCHDOG = 250,
+	VIDEO_CRATE = 90000,
 };
 
 enum state {
@@ -43,10 +54,36 @@ struct mcreceiver {
 	struct udp_sock *rtp;
 	uint32_t ssrc;
 	struct jbuf *jbuf;
+	struct range jbuf_del;
+	enum jbuf_type jbtype;
 
 	const struct aucodec *ac;
+	const struct vidcodec *vc;
+	struct mczone *zone;
 
 	struct tmr timeout;
+	struct tmr idle;
+	RE_ATOMIC uint64_t last_seen;
+
+	struct {
+		uint32_t ssrc;        /**< SSRC of the non-playing stream    */
+		RE_ATOMIC uint32_t gen;   /**< Priority table generation     */
+		RE_ATOMIC uint32_t calls; /**< Call count at last evaluation */
+		uint64_t packets;     /**< Packets taken by the fast path    */
+	} fast;
+
+	struct {
+		bool kernel;          /**< Kernel RX timestamps available   */
+		uint64_t arrive;      /**< Arrival time of last packet [us] */
+		uint64_t base;        /**< Arrival time of first packet [us]*/
+		uint32_t transit_net;
+		uint32_t transit_host;
+		uint32_t jitter_net;  /**< Network jitter * 16 [RTP units]  */
+		uint32_t jitter_host; /**< Host jitter * 16 [RTP units]     */
+		uint64_t queue_sum;   /**< Sum of queueing delays [us]      */
+		uint64_t queue_max;   /**< Max. queueing delay [us]         */
+		uint64_t n;
+	} rxts;
 
 	enum state state;
 	bool muted;
@@ -55,6 +92,7 @@ struct mcreceiver {
 
 
 static void resume_uag_state(void);
+static void timeout_handler(void *arg);
 
 
 static char* state_str(enum state s) {
@@ -73,14 +111,29 @@ static char* state_str(enum state s) {
 }
 
 
+/**
+ * Stop the audio or video player of the multicast receiver
+ *
+ * @param mcreceiver Multicast receiver object
+ */
+static void player_stop(const struct mcreceiver *mcreceiver)
+{
+	if (mcreceiver->vc)
+		mcvidplayer_stop();
+	else
+		mcplayer_stop(mcreceiver->zone);
+}
+
+
 static void mcreceiver_destructor(void *arg)
 {
 	struct mcreceiver *mcreceiver = arg;
 
 	tmr_cancel(&mcreceiver->timeout);
+	tmr_cancel(&mcreceiver->idle);
 
 	if (mcreceiver->state == RUNNING)
-		mcplayer_stop();
+		player_stop(mcreceiver);
 
 	mcreceiver->ssrc = 0;
 
@@ -89,6 +142,216 @@ static void mcreceiver_destructor(void *arg)
 }
 
 
+/**
+ * Allocate the jitter buffer of a multicast receiver on demand
+ *
+ * @param mcreceiver Multicast receiver object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mcreceiver_rx_alloc(struct mcreceiver *mcreceiver)
+{
+	int err;
+
+	tmr_cancel(&mcreceiver->idle);
+	if (mcreceiver->jbuf)
+		return 0;
+
+	err = jbuf_alloc(&mcreceiver->jbuf, mcreceiver->jbuf_del.min,
+		mcreceiver->jbuf_del.max);
+	err |= jbuf_set_type(mcreceiver->jbuf, mcreceiver->jbtype);
+	if (err) {
+		warning("multicast receiver: jbuf alloc failed %J (%m)\n",
+			&mcreceiver->addr, err);
+		mcreceiver->jbuf = mem_deref(mcreceiver->jbuf);
+	}
+
+	return err;
+}
+
+
+/**
+ * Release the jitter buffer of an idle multicast receiver
+ *
+ * @param arg Multicast receiver object
+ */
+static void idle_handler(void *arg)
+{
+	struct mcreceiver *mcreceiver = arg;
+
+	mtx_lock(&mcreceivl_lock);
+	if (mcreceiver->state == LISTENING)
+		mcreceiver->jbuf = mem_deref(mcreceiver->jbuf);
+	mtx_unlock(&mcreceivl_lock);
+}
+
+
+/**
+ * Invalidate the fast path of all non-playing receivers
+ */
+static void prio_changed(void)
+{
+	re_atomic_rlx_add(&prio_gen, 1);
+}
+
+
+/**
+ * Fast path for packets of non-playing receivers
+ *
+ * A receiver in RECEIVING or IGNORED state only needs to know that its
+ * stream is still alive. As long as neither the SSRC nor the priority table
+ * changed, the packet costs a header peek and an atomic last-seen update.
+ *
+ * @param mcreceiver Multicast receiver object
+ * @param mb         RTP packet
+ *
+ * @return true if the packet was handled, otherwise false
+ */
+static bool rx_fastpath(struct mcreceiver *mcreceiver, const struct mbuf *mb)
+{
+	struct rtp_header hdr;
+	const uint8_t *p;
+	uint32_t ssrc;
+
+	if (mcreceiver->state != RECEIVING && mcreceiver->state != IGNORED)
+		return false;
+
+	if (re_atomic_rlx(&mcreceiver->fast.gen) != re_atomic_rlx(&prio_gen) ||
+	    mbuf_get_left(mb) < RTP_HEADER_SIZE)
+		return false;
+
+	p = mbuf_buf(mb);
+	ssrc = (uint32_t)p[8] << 24 | (uint32_t)p[9] << 16 |
+		(uint32_t)p[10] << 8 | (uint32_t)p[11];
+	if (ssrc != mcreceiver->fast.ssrc)
+		return false;
+
+	/* the benchmark needs every received packet */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.seq  = (uint16_t)(p[2] << 8 | p[3]);
+	hdr.ssrc = ssrc;
+	mcbench_rtp(&mcreceiver->addr, &hdr, false);
+
+	re_atomic_rlx_set(&mcreceiver->last_seen, tmr_jiffies());
+	++mcreceiver->fast.packets;
+	return true;
+}
+
+
+/**
+ * Get the kernel arrival time of the last received packet
+ *
+ * @param mcreceiver Multicast receiver object
+ *
+ * @return Arrival time in [us] (realtime clock), 0 if not available
+ */
+static uint64_t rx_kernel_time(const struct mcreceiver *mcreceiver)
+{
+#if defined(LINUX) && defined(SIOCGSTAMPNS)
+	struct timespec ts;
+	int fd = udp_sock_fd(mcreceiver->rtp, sa_af(&mcreceiver->addr));
+
+	if (fd < 0 || ioctl(fd, SIOCGSTAMPNS, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+	(void)mcreceiver;
+	return 0;
+#endif
+}
+
+
+/**
+ * Update the RFC 3550 interarrival jitter
+ *
+ * @param jitter  Jitter * 16 in [RTP units]
+ * @param transit Previous transit time in [RTP units]
+ * @param arrive  Arrival time relative to the first packet in [us]
+ * @param hdr     RTP header
+ * @param crate   RTP clock rate
+ */
+static void jitter_update(uint32_t *jitter, uint32_t *transit,
+	uint64_t arrive, const struct rtp_header *hdr, uint32_t crate)
+{
+	uint32_t t = (uint32_t)(arrive * crate / 1000000) - hdr->ts;
+	int32_t d = (int32_t)(t - *transit);
+
+	if (d < 0)
+		d = -d;
+
+	*transit = t;
+	*jitter += d - ((*jitter + 8) >> 4);
+}
+
+
+/**
+ * Convert a RFC 3550 jitter value to [us]
+ *
+ * @param mcreceiver Multicast receiver object
+ * @param jitter     Jitter * 16 in [RTP units]
+ *
+ * @return Jitter in [us]
+ */
+static uint64_t jitter_usec(const struct mcreceiver *mcreceiver,
+	uint32_t jitter)
+{
+	uint32_t crate = VIDEO_CRATE;
+
+	if (!mcreceiver->vc)
+		crate = mcreceiver->ac ? mcreceiver->ac->crate : 8000;
+
+	return (uint64_t)(jitter >> 4) * 1000000 / crate;
+}
+
+
+/**
+ * Update the receive timing statistics
+ *
+ * The network jitter is based on the kernel arrival time, the host jitter on
+ * the time the RTP handler runs. The difference of both is the in-process
+ * queueing delay.
+ *
+ * @param mcreceiver Multicast receiver object
+ * @param hdr        RTP header
+ */
+static void rxts_update(struct mcreceiver *mcreceiver,
+	const struct rtp_header *hdr)
+{
+	uint64_t now = tmr_jiffies_rt_usec();
+	uint64_t arrive = mcreceiver->rxts.arrive;
+	uint32_t crate = VIDEO_CRATE;
+	bool first = mcreceiver->rxts.n == 0;
+
+	if (!mcreceiver->vc)
+		crate = mcreceiver->ac ? mcreceiver->ac->crate : 8000;
+
+	mcreceiver->rxts.kernel = arrive != 0;
+	if (!arrive || arrive > now)
+		arrive = now;
+
+	if (first)
+		mcreceiver->rxts.base = arrive;
+
+	jitter_update(&mcreceiver->rxts.jitter_net,
+		&mcreceiver->rxts.transit_net,
+		arrive - mcreceiver->rxts.base, hdr, crate);
+	jitter_update(&mcreceiver->rxts.jitter_host,
+		&mcreceiver->rxts.transit_host,
+		now - mcreceiver->rxts.base, hdr, crate);
+
+	if (first) {
+		mcreceiver->rxts.jitter_net  = 0;
+		mcreceiver->rxts.jitter_host = 0;
+	}
+
+	mcreceiver->rxts.queue_sum += now - arrive;
+	mcreceiver->rxts.queue_max = max(mcreceiver->rxts.queue_max,
+		now - arrive);
+	++mcreceiver->rxts.n;
+}
+
+
 /**
  * Multicast address comparison
  *
@@ -126,10 +389,10 @@ static bool mcreceiver_prio_cmp(struct le *le, void *arg)
 
 
 /**
- * Get running multicast receiver
+ * Get running multicast receiver of the same media type and player zone
  *
  * @param le  Multicast receiver list element
- * @param arg Unused
+ * @param arg Multicast receiver object to compare media type and zone
  *
  * @return true if multicast receiver is running
  * @return false if multicast receiver is not running
@@ -137,9 +400,11 @@ static bool mcreceiver_prio_cmp(struct le *le, void *arg)
 static bool mcreceiver_running(struct le *le, void *arg)
 {
 	struct mcreceiver *mcreceiver = le->data;
-	(void) arg;
+	const struct mcreceiver *other = arg;
 
-	return mcreceiver->state == RUNNING;
+	return mcreceiver->state == RUNNING &&
+		(mcreceiver->vc != NULL) == (other->vc != NULL) &&
+		mcreceiver->zone == other->zone;
 }
 
 
@@ -211,8 +476,12 @@ static void resume_uag_state(void)
  */
 static int player_stop_start(struct mcreceiver *mcreceiver)
 {
-	mcplayer_fadeout();
-	return mcplayer_start(mcreceiver->ac);
+	if (mcreceiver->vc)
+		return mcvidplayer_start(mcreceiver->vc);
+
+	mcplayer_fadeout(mcreceiver->zone);
+	return mcplayer_start(mcreceiver->zone, mcreceiver->ac,
+		mcreceiver->jbuf);
 }
 
 
@@ -220,12 +489,8 @@ static void mcreceiver_stop(struct mcreceiver *mcreceiver)
 {
 	mcreceiver->state = RECEIVING;
 
-	module_event("multicast",
-		     "receiver stopped playing", NULL, NULL,
-		     "addr=%J prio=%d enabled=%d state=%s",
-		     &mcreceiver->addr, mcreceiver->prio,
-		     mcreceiver->enable,
-		     state_str(mcreceiver->state));
+	mcevent_emit(MCEVENT_STOP, &mcreceiver->addr, mcreceiver->prio,
+		mcreceiver->enable, state_str(mcreceiver->state));
 
 	jbuf_flush(mcreceiver->jbuf);
 }
@@ -253,16 +518,15 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		return ENOMEM;
 
 	if (mcreceiver->state == LISTENING) {
-		mcreceiver->state = RECEIVING;
+		err = mcreceiver_rx_alloc(mcreceiver);
+		if (err)
+			goto out;
 
-		info ("multicast receiver: start addr=%J prio=%d enabled=%d "
-			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcreceiver->state = RECEIVING;
 
-		module_event("multicast", "receiver start", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcevent_emit(MCEVENT_START, &mcreceiver->addr,
+			mcreceiver->prio, mcreceiver->enable,
+			state_str(mcreceiver->state));
 
 	}
 
@@ -280,7 +544,7 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 	if (mcreceiver->prio >= multicast_callprio() && uag_call_count()) {
 		if (mcreceiver->state == RUNNING) {
 			mcreceiver_stop(mcreceiver);
-			mcplayer_stop();
+			player_stop(mcreceiver);
 		}
 		goto out;
 	}
@@ -311,7 +575,7 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		}
 	}
 
-	le = list_apply(&mcreceivl, true, mcreceiver_running, NULL);
+	le = list_apply(&mcreceivl, true, mcreceiver_running, mcreceiver);
 	if (!le) {
 		err = player_stop_start(mcreceiver);
 		if (err)
@@ -320,14 +584,9 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		mcreceiver->state = RUNNING;
 		mcreceiver->ssrc = ssrc;
 
-		info ("multicast receiver: start addr=%J prio=%d enabled=%d "
-			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
-
-		module_event("multicast", "receiver start", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcevent_emit(MCEVENT_START, &mcreceiver->addr,
+			mcreceiver->prio, mcreceiver->enable,
+			state_str(mcreceiver->state));
 
 		goto out;
 	}
@@ -341,17 +600,14 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		if (hprio->state == IGNORED)
 			hprio->state = RUNNING;
 
-		mcplayer_fadein(true);
-		mcreceiver->ssrc = ssrc;
+		if (!mcreceiver->vc)
+			mcplayer_fadein(mcreceiver->zone, true);
 
-		info ("multicast receiver: restart addr=%J prio=%d enabled=%d "
-			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcreceiver->ssrc = ssrc;
 
-		module_event("multicast", "receiver restart", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcevent_emit(MCEVENT_RESTART, &mcreceiver->addr,
+			mcreceiver->prio, mcreceiver->enable,
+			state_str(mcreceiver->state));
 
 		goto out;
 	}
@@ -369,15 +625,9 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 	mcreceiver->ssrc = ssrc;
 
 
-	info ("multicast receiver: start addr=%J prio=%d enabled=%d "
-		"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
+	mcevent_emit(MCEVENT_START, &mcreceiver->addr, mcreceiver->prio,
 		mcreceiver->enable, state_str(mcreceiver->state));
 
-	module_event("multicast", "receiver start", NULL, NULL,
-		"addr=%J prio=%d enabled=%d state=%s",
-		&mcreceiver->addr, mcreceiver->prio, mcreceiver->enable,
-		state_str(mcreceiver->state));
-
   out:
 	mtx_unlock(&mcreceivl_lock);
 	return err;
@@ -392,18 +642,26 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 static void timeout_handler(void *arg)
 {
 	struct mcreceiver *mcreceiver = arg;
-	info ("multicast receiver: EOS addr=%J prio=%d enabled=%d state=%s\n",
-		&mcreceiver->addr, mcreceiver->prio, mcreceiver->enable,
-		state_str(mcreceiver->state));
+	uint64_t idle = tmr_jiffies() - re_atomic_rlx(&mcreceiver->last_seen);
+
+	if (idle < TIMEOUT) {
+		uint32_t calls = uag_call_count();
 
-	module_event("multicast", "receiver EOS", NULL, NULL,
-		"addr=%J prio=%d enabled=%d state=%s",
-		&mcreceiver->addr, mcreceiver->prio, mcreceiver->enable,
-		state_str(mcreceiver->state));
+		/* the call priority check depends on the call count */
+		if (calls != re_atomic_rlx(&mcreceiver->fast.calls))
+			re_atomic_rlx_set(&mcreceiver->fast.gen, 0);
+
+		tmr_start(&mcreceiver->timeout, min(TIMEOUT - idle, WATCHDOG),
+			timeout_handler, mcreceiver);
+		return;
+	}
+
+	mcevent_emit(MCEVENT_EOS, &mcreceiver->addr, mcreceiver->prio,
+		mcreceiver->enable, state_str(mcreceiver->state));
 
 	mtx_lock(&mcreceivl_lock);
 	if (mcreceiver->state == RUNNING) {
-		mcplayer_stop();
+		player_stop(mcreceiver);
 		jbuf_flush(mcreceiver->jbuf);
 	}
 
@@ -411,35 +669,38 @@ static void timeout_handler(void *arg)
 	mcreceiver->muted = false;
 	mcreceiver->ssrc = 0;
 	mcreceiver->ac   = 0;
+	memset(&mcreceiver->rxts, 0, sizeof(mcreceiver->rxts));
+	prio_changed();
 	resume_uag_state();
 
 	mtx_unlock(&mcreceivl_lock);
+
+	tmr_start(&mcreceiver->idle, multicast_rx_idle_time(), idle_handler,
+		mcreceiver);
 	return;
 }
 
 
 /**
- * Decode RTP packet
+ * Decode all available RTP packets of a video receiver
  *
- * @return 0 if success, otherwise errorcode
+ * @param mcreceiver Multicast receiver object
  */
-static int player_decode(struct mcreceiver *mcreceiver)
+static void vidplayer_decode(struct mcreceiver *mcreceiver)
 {
-	void *mb = NULL;
 	struct rtp_header hdr;
+	void *mb;
 	int jerr;
-	int err;
 
-	jerr = jbuf_get(mcreceiver->jbuf, &hdr, &mb);
-	if (jerr && jerr != EAGAIN)
-		return jerr;
-
-	err = mcplayer_decode(&hdr, mb, jerr == EAGAIN);
-	mb = mem_deref(mb);
-	if (err)
-		return err;
+	do {
+		mb = NULL;
+		jerr = jbuf_get(mcreceiver->jbuf, &hdr, &mb);
+		if (jerr && jerr != EAGAIN)
+			break;
 
-	return jerr;
+		(void)mcvidplayer_decode(&hdr, mb);
+		mem_deref(mb);
+	} while (jerr == EAGAIN);
 }
 
 
@@ -456,24 +717,48 @@ static void rtp_handler(const struct sa *src, const struct rtp_header *hdr,
 {
 	int err = 0;
 	struct mcreceiver *mcreceiver = arg;
+	uint32_t gen;
 
 	(void) src;
 	(void) mb;
 
-	mcreceiver->ac = pt2codec(hdr);
-	if (!mcreceiver->ac)
+	/* comfort noise keeps a DTX stream alive, nothing to decode */
+	if (hdr->pt == PT_CN && !mcreceiver->vc) {
+		if (mcreceiver->state == LISTENING)
+			return;
+
 		goto out;
+	}
+
+	if (!mcreceiver->vc) {
+		mcreceiver->ac = pt2codec(hdr);
+		if (!mcreceiver->ac)
+			goto out;
+	}
 
 	if (!mbuf_get_left(mb))
 		goto out;
 
+	rxts_update(mcreceiver, hdr);
+
+	/* a concurrent priority change must invalidate this evaluation */
+	gen = re_atomic_rlx(&prio_gen);
 	err = prio_handling(mcreceiver, hdr->ssrc);
+	mcbench_rtp(&mcreceiver->addr, hdr, mcreceiver->state == RUNNING);
+
+	/* ECANCELED is a finished evaluation of an ignored or disabled
+	 * receiver, arm the fast path unless the evaluation failed */
+	if (!err || err == ECANCELED) {
+		mcreceiver->fast.ssrc = hdr->ssrc;
+		re_atomic_rlx_set(&mcreceiver->fast.calls, uag_call_count());
+		re_atomic_rlx_set(&mcreceiver->fast.gen, gen);
+	}
+
 	if (err)
 		goto out;
 
-	if (mcreceiver->state == RUNNING) {
-		if (mcreceiver->muted && mcplayer_fadeout_done()) {
-			mcplayer_stop();
+	if (mcreceiver->state == RUNNING && mcreceiver->vc) {
+		if (mcreceiver->muted) {
 			jbuf_flush(mcreceiver->jbuf);
 			goto out;
 		}
@@ -482,13 +767,28 @@ static void rtp_handler(const struct sa *src, const struct rtp_header *hdr,
 		if (err)
 			return;
 
-		if (player_decode(mcreceiver) == EAGAIN) {
-			(void) player_decode(mcreceiver);
+		vidplayer_decode(mcreceiver);
+	}
+	else if (mcreceiver->state == RUNNING) {
+		if (mcreceiver->muted &&
+			mcplayer_fadeout_done(mcreceiver->zone)) {
+			mcplayer_stop(mcreceiver->zone);
+			jbuf_flush(mcreceiver->jbuf);
+			goto out;
 		}
+
+		err = jbuf_put(mcreceiver->jbuf, hdr, mb);
+		if (err)
+			return;
+
+		mcplayer_decode(mcreceiver->zone);
 	}
 
   out:
-	tmr_start(&mcreceiver->timeout, TIMEOUT, timeout_handler, mcreceiver);
+	re_atomic_rlx_set(&mcreceiver->last_seen, tmr_jiffies());
+	if (!tmr_isrunning(&mcreceiver->timeout))
+		tmr_start(&mcreceiver->timeout, WATCHDOG, timeout_handler,
+			mcreceiver);
 
 	return;
 }
@@ -511,6 +811,12 @@ static void rtp_handler_wrapper(const struct sa *src,
 {
 	int err = 0;
 	struct rtp_header hdr;
+	struct mcreceiver *mcreceiver = arg;
+
+	if (rx_fastpath(mcreceiver, mb))
+		return;
+
+	mcreceiver->rxts.arrive = rx_kernel_time(mcreceiver);
 
 	err = rtp_decode((struct rtp_sock*)0xdeadbeef, mb, &hdr);
 	if (err) {
@@ -518,6 +824,14 @@ static void rtp_handler_wrapper(const struct sa *src,
 		return;
 	}
 
+	/* carry the kernel arrival time to the jitter buffer */
+	if (mcreceiver->rxts.arrive) {
+		uint64_t delay = tmr_jiffies_rt_usec() -
+			mcreceiver->rxts.arrive;
+
+		hdr.ts_arrive = tmr_jiffies() - delay / 1000;
+	}
+
 	rtp_handler(src, &hdr, mb, arg);
 }
 
@@ -547,12 +861,13 @@ void mcreceiver_enprio(uint32_t prio)
 
 			if (mcreceiver->state == RUNNING) {
 				mcreceiver_stop(mcreceiver);
-				mcplayer_stop();
+				player_stop(mcreceiver);
 			}
 		}
 	}
 
 	mtx_unlock(&mcreceivl_lock);
+	prio_changed();
 	resume_uag_state();
 }
 
@@ -581,12 +896,13 @@ void mcreceiver_enrangeprio(uint32_t priol, uint32_t prioh, bool en)
 
 			if (mcreceiver->state == RUNNING) {
 				mcreceiver_stop(mcreceiver);
-				mcplayer_stop();
+				player_stop(mcreceiver);
 			}
 		}
 	}
 
 	mtx_unlock(&mcreceivl_lock);
+	prio_changed();
 	resume_uag_state();
 }
 
@@ -605,12 +921,14 @@ void mcreceiver_enable(bool enable)
 	LIST_FOREACH(&mcreceivl, le) {
 		mcreceiver = le->data;
 		mcreceiver->enable = enable;
-		if (mcreceiver->state == RUNNING)
+		if (mcreceiver->state == RUNNING) {
 			mcreceiver_stop(mcreceiver);
+			player_stop(mcreceiver);
+		}
 	}
 
 	mtx_unlock(&mcreceivl_lock);
-	mcplayer_stop();
+	prio_changed();
 	resume_uag_state();
 }
 
@@ -627,6 +945,7 @@ int mcreceiver_chprio(struct sa *addr, uint32_t prio)
 {
 	struct le *le;
 	struct mcreceiver *mcreceiver;
+	struct mczone *zone = NULL;
 
 	if (!addr || !prio)
 		return EINVAL;
@@ -644,9 +963,25 @@ int mcreceiver_chprio(struct sa *addr, uint32_t prio)
 	}
 
 	mcreceiver = le->data;
+	if (!mcreceiver->vc) {
+		zone = mcplayer_zone(prio);
+		if (!zone) {
+			warning ("multicast receiver: no player zone for "
+				"priority %d\n", prio);
+			return EINVAL;
+		}
+	}
+
 	mtx_lock(&mcreceivl_lock);
+	if (mcreceiver->zone != zone && mcreceiver->state == RUNNING) {
+		mcreceiver_stop(mcreceiver);
+		player_stop(mcreceiver);
+	}
+
 	mcreceiver->prio = prio;
+	mcreceiver->zone = zone;
 	mtx_unlock(&mcreceivl_lock);
+	prio_changed();
 	resume_uag_state();
 	return 0;
 }
@@ -682,7 +1017,7 @@ int mcreceiver_prioignore(uint32_t prio)
 	switch (mcreceiver->state) {
 		case RUNNING:
 			mcreceiver->state = IGNORED;
-			mcplayer_stop();
+			player_stop(mcreceiver);
 			jbuf_flush(mcreceiver->jbuf);
 			break;
 		case RECEIVING:
@@ -696,6 +1031,7 @@ int mcreceiver_prioignore(uint32_t prio)
 	}
 
 	mtx_unlock(&mcreceivl_lock);
+	prio_changed();
 	resume_uag_state();
 	return err;
 }
@@ -726,13 +1062,20 @@ int mcreceiver_mute(uint32_t prio)
 	mcreceiver = le->data;
 	mtx_lock(&mcreceivl_lock);
 	mcreceiver->muted = !mcreceiver->muted;
-	if (mcreceiver->state == RUNNING) {
+	if (mcreceiver->state == RUNNING && mcreceiver->vc) {
+		if (mcreceiver->muted)
+			mcvidplayer_stop();
+		else
+			err = mcvidplayer_start(mcreceiver->vc);
+	}
+	else if (mcreceiver->state == RUNNING) {
 		if (mcreceiver->muted) {
-			mcplayer_fadeout();
+			mcplayer_fadeout(mcreceiver->zone);
 		}
 		else {
-			mcplayer_fadein(false);
-			err = mcplayer_start(mcreceiver->ac);
+			mcplayer_fadein(mcreceiver->zone, false);
+			err = mcplayer_start(mcreceiver->zone,
+				mcreceiver->ac, mcreceiver->jbuf);
 			if (err == EINPROGRESS)
 				err = 0;
 		}
@@ -750,6 +1093,7 @@ void mcreceiver_unregall(void)
 	mtx_lock(&mcreceivl_lock);
 	list_flush(&mcreceivl);
 	mtx_unlock(&mcreceivl_lock);
+	prio_changed();
 	resume_uag_state();
 	mtx_destroy(&mcreceivl_lock);
 }
@@ -775,6 +1119,7 @@ void mcreceiver_unreg(struct sa *addr){
 	list_unlink(&mcreceiver->le);
 	mtx_unlock(&mcreceivl_lock);
 	mem_deref(mcreceiver);
+	prio_changed();
 	resume_uag_state();
 
 	if (list_isempty(&mcreceivl))
@@ -787,17 +1132,17 @@ void mcreceiver_unreg(struct sa *addr){
  *
  * @param addr Listen address
  * @param prio Listener priority
+ * @param vc   Video codec for a video listener, NULL for audio
  *
  * @return int 0 if success, errorcode otherwise
  */
-int mcreceiver_alloc(struct sa *addr, uint8_t prio)
+int mcreceiver_alloc(struct sa *addr, uint8_t prio,
+	const struct vidcodec *vc)
 {
 	int err = 0;
 	uint16_t port;
 	struct mcreceiver *mcreceiver = NULL;
 	struct config_avt *cfg = &conf_config()->avt;
-	struct range jbuf_del;
-	enum jbuf_type jbtype;
 	struct pl pl;
 
 	if (!addr || !prio)
@@ -815,6 +1160,12 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 		return EADDRINUSE;
 	}
 
+	if (!vc && !mcplayer_zone(prio)) {
+		warning ("multicast receiver: no player zone for priority "
+			"%d\n", prio);
+		return EINVAL;
+	}
+
 	mcreceiver = mem_zalloc(sizeof(*mcreceiver), mcreceiver_destructor);
 	if (!mcreceiver)
 		return ENOMEM;
@@ -830,21 +1181,26 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 	sa_cpy(&mcreceiver->addr, addr);
 	port = sa_port(&mcreceiver->addr);
 	mcreceiver->prio = prio;
+	mcreceiver->vc = vc;
+	if (!vc)
+		mcreceiver->zone = mcplayer_zone(prio);
 
 	mcreceiver->enable = true;
 	mcreceiver->muted = false;
 	mcreceiver->state = LISTENING;
 
-	jbuf_del  = cfg->audio.jbuf_del;
-	jbtype = cfg->audio.jbtype;
-	(void)conf_get_range(conf_cur(), "multicast_jbuf_delay", &jbuf_del);
+	/* the jbuf is allocated on the first received RTP packet */
+	mcreceiver->jbuf_del = cfg->audio.jbuf_del;
+	mcreceiver->jbtype   = cfg->audio.jbtype;
+	(void)conf_get_range(conf_cur(), "multicast_jbuf_delay",
+		&mcreceiver->jbuf_del);
 	if (0 == conf_get(conf_cur(), "multicast_jbuf_type", &pl))
-		jbtype = conf_get_jbuf_type(&pl);
+		mcreceiver->jbtype = conf_get_jbuf_type(&pl);
 
-	err = jbuf_alloc(&mcreceiver->jbuf, jbuf_del.min, jbuf_del.max);
-	err |= jbuf_set_type(mcreceiver->jbuf, jbtype);
-	if (err)
-		goto out;
+	if (vc) {
+		mcreceiver->jbuf_del = cfg->video.jbuf_del;
+		mcreceiver->jbtype   = cfg->video.jbtype;
+	}
 
 	err = udp_listen(&mcreceiver->rtp, &mcreceiver->addr,
 		rtp_handler_wrapper, mcreceiver);
@@ -855,6 +1211,11 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 		goto out;
 	}
 
+#ifdef SO_TIMESTAMPNS
+	(void)udp_setsockopt(mcreceiver->rtp, SOL_SOCKET, SO_TIMESTAMPNS,
+		&(int){1}, sizeof(int));
+#endif
+
 	if (IN_MULTICAST(sa_in(&mcreceiver->addr))) {
 		err = udp_multicast_join((struct udp_sock *)
 			mcreceiver->rtp, &mcreceiver->addr);
@@ -886,13 +1247,55 @@ void mcreceiver_print(struct re_printf *pf)
 {
 	struct le *le = NULL;
 	struct mcreceiver *mcreceiver = NULL;
+	struct {
+		uint32_t n;
+		uint32_t n_jbuf;
+		uint32_t n_pkt;
+	} fp[IGNORED + 1];
+	enum state s;
+
+	memset(fp, 0, sizeof(fp));
 
 	re_hprintf(pf, "Multicast Receiver List:\n");
 	LIST_FOREACH(&mcreceivl, le) {
 		mcreceiver = le->data;
 		re_hprintf(pf, "   addr=%J prio=%d enabled=%d muted=%d "
-			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
+			"state=%s jbuf=%s fastpath=%llu%s%s\n",
+			&mcreceiver->addr, mcreceiver->prio,
 			mcreceiver->enable, mcreceiver->muted,
-			state_str(mcreceiver->state));
+			state_str(mcreceiver->state),
+			mcreceiver->jbuf ? "yes" : "no",
+			mcreceiver->fast.packets,
+			mcreceiver->vc ? " video=" : "",
+			mcreceiver->vc ? mcreceiver->vc->name : "");
+
+		if (mcreceiver->rxts.n) {
+			re_hprintf(pf, "      jitter net=%lluus host=%lluus "
+				"queue avg=%lluus max=%lluus%s\n",
+				jitter_usec(mcreceiver,
+					mcreceiver->rxts.jitter_net),
+				jitter_usec(mcreceiver,
+					mcreceiver->rxts.jitter_host),
+				mcreceiver->rxts.queue_sum /
+				mcreceiver->rxts.n, mcreceiver->rxts.queue_max,
+				mcreceiver->rxts.kernel ? "" :
+				" (no kernel timestamps)");
+		}
+
+		++fp[mcreceiver->state].n;
+		if (mcreceiver->jbuf) {
+			++fp[mcreceiver->state].n_jbuf;
+			fp[mcreceiver->state].n_pkt +=
+				jbuf_packets(mcreceiver->jbuf);
+		}
+	}
+
+	/* the jitter buffers are opaque, only their packets are counted */
+	re_hprintf(pf, "Multicast Receiver Memory:\n");
+	for (s = LISTENING; s <= IGNORED; s++) {
+		re_hprintf(pf, "   %s: receiver=%u (struct %zu bytes) jbuf=%u "
+			"packets=%u\n", state_str(s), fp[s].n,
+			fp[s].n * sizeof(struct mcreceiver), fp[s].n_jbuf,
+			fp[s].n_pkt);
 	}
 }
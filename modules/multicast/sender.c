@@ -33,8 +33,11 @@ struct mcsender {
 
 	struct config_audio *cfg;
 	const struct aucodec *ac;
+	const struct vidcodec *vc;
+	uint8_t pt;
 
 	struct mcsource *src;
+	struct mcvidsource *vidsrc;
 	bool enable;
 };
 
@@ -45,6 +48,7 @@ static void mcsender_destructor(void *arg)
 
 	mcsource_stop(mcsender->src);
 	mcsender->src = mem_deref(mcsender->src);
+	mcsender->vidsrc = mem_deref(mcsender->vidsrc);
 	mcsender->rtp = mem_deref(mcsender->rtp);
 }
 
@@ -76,11 +80,10 @@ static bool mcsender_addr_cmp(struct le *le, void *arg)
  *
  * @return 0 if success, otherwise errorcode
  */
-static int mcsender_send_handler(size_t ext_len, bool marker,
+static int mcsender_send_handler(size_t ext_len, bool marker, bool cn,
 	uint32_t rtp_ts, struct mbuf *mb, void *arg)
 {
 	struct mcsender *mcsender = arg;
-	struct pl placpt = PL_INIT;
 	int err = 0;
 
 	if (!mb)
@@ -92,9 +95,8 @@ static int mcsender_send_handler(size_t ext_len, bool marker,
 	if (uag_call_count())
 		return 0;
 
-	pl_set_str(&placpt, mcsender->ac->pt);
 	err = rtp_send(mcsender->rtp, &mcsender->addr, ext_len != 0, marker,
-		pl_u32(&placpt), rtp_ts, tmr_jiffies_rt_usec(), mb);
+		cn ? PT_CN : mcsender->pt, rtp_ts, tmr_jiffies_rt_usec(), mb);
 
 	return err;
 }
@@ -149,22 +151,19 @@ void mcsender_stop(struct sa *addr)
 
 
 /**
- * Allocate a new multicast sender object
+ * Allocate a multicast sender object with an open RTP socket
  *
- * @param addr  Destination address
- * @param codec Used audio codec
+ * @param mcsenderp Multicast sender ptr
+ * @param addr      Destination address
  *
  * @return 0 if success, otherwise errorcode
  */
-int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
+static int mcsender_alloc_rtp(struct mcsender **mcsenderp, struct sa *addr)
 {
 	int err = 0;
 	struct mcsender *mcsender = NULL;
 	uint8_t ttl = multicast_ttl();
 
-	if (!addr || !codec)
-		return EINVAL;
-
 	if (list_apply(&mcsenderl, true, mcsender_addr_cmp, addr))
 		return EADDRINUSE;
 
@@ -174,7 +173,6 @@ int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
 		return ENOMEM;
 
 	sa_cpy(&mcsender->addr, addr);
-	mcsender->ac = codec;
 	mcsender->enable = true;
 
 	err = rtp_open(&mcsender->rtp, sa_af(&mcsender->addr));
@@ -189,8 +187,88 @@ int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
 			IP_MULTICAST_TTL, &ttl, sizeof(ttl));
 	}
 
+ out:
+	if (err)
+		mem_deref(mcsender);
+	else
+		*mcsenderp = mcsender;
+
+	return err;
+}
+
+
+/**
+ * Allocate a new multicast sender object
+ *
+ * @param addr  Destination address
+ * @param codec Used audio codec
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
+{
+	int err = 0;
+	struct mcsender *mcsender = NULL;
+	struct pl placpt = PL_INIT;
+
+	if (!addr || !codec)
+		return EINVAL;
+
+	err = mcsender_alloc_rtp(&mcsender, addr);
+	if (err)
+		return err;
+
+	mcsender->ac = codec;
+	pl_set_str(&placpt, mcsender->ac->pt);
+	mcsender->pt = pl_u32(&placpt);
+
 	err = mcsource_start(&mcsender->src, mcsender->ac,
 		mcsender_send_handler, mcsender);
+	if (err)
+		goto out;
+
+	list_append(&mcsenderl, &mcsender->le, mcsender);
+
+ out:
+	if (err)
+		mem_deref(mcsender);
+
+	return err;
+}
+
+
+/**
+ * Allocate a new multicast video sender object
+ *
+ * @param addr Destination address
+ * @param vc   Used video codec
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcsender_vidalloc(struct sa *addr, const struct vidcodec *vc)
+{
+	int err = 0;
+	struct mcsender *mcsender = NULL;
+	struct pl plpt = PL_INIT;
+
+	if (!addr || !vc)
+		return EINVAL;
+
+	err = mcsender_alloc_rtp(&mcsender, addr);
+	if (err)
+		return err;
+
+	mcsender->vc = vc;
+	mcsender->pt = VIDEO_PT;
+	if (str_isset(vc->pt)) {
+		pl_set_str(&plpt, vc->pt);
+		mcsender->pt = pl_u32(&plpt);
+	}
+
+	err = mcvidsource_start(&mcsender->vidsrc, mcsender->vc,
+		mcsender_send_handler, mcsender);
+	if (err)
+		goto out;
 
 	list_append(&mcsenderl, &mcsender->le, mcsender);
 
@@ -215,8 +293,9 @@ void mcsender_print(struct re_printf *pf)
 	re_hprintf(pf, "Multicast Sender List:\n");
 	LIST_FOREACH(&mcsenderl, le) {
 		mcsender = le->data;
-		re_hprintf(pf, "   %J - %s%s\n", &mcsender->addr,
-			mcsender->ac->name,
+		re_hprintf(pf, "   %J - %s%s%s\n", &mcsender->addr,
+			mcsender->vc ? mcsender->vc->name : mcsender->ac->name,
+			mcsender->vc ? " (video)" : "",
 			mcsender->enable ? " (enabled)" : " (disabled)");
 	}
 }
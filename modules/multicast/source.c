@@ -18,6 +18,29 @@
 #include <re_dbg.h>
 
 
+enum {
+	GOV_FRAMES = 50,             /* Frames per governor measurement */
+};
+
+
+/**
+ * Encoder governor levels
+ *
+ * Each level reduces the encoder CPU load by a larger frame size or a
+ * lower bitrate (divisor of the configured multicast_bitrate)
+ */
+static const struct {
+	uint32_t ptime;
+	uint32_t brdiv;
+} govlevelv[] = {
+	{PTIME,     1},
+	{2 * PTIME, 1},
+	{MAX_PTIME, 1},
+	{MAX_PTIME, 2},
+	{MAX_PTIME, 4},
+};
+
+
 /**
  * Multicast source struct
  *
@@ -57,6 +80,25 @@ struct mcsource {
 		thrd_t tid;
 		RE_ATOMIC bool run;
 	} thr;
+
+	struct {
+		uint32_t budget;
+		uint32_t bitrate;
+		uint64_t enc_usec;
+		uint32_t frames;
+		uint32_t level;
+		RE_ATOMIC uint32_t load;
+		struct mqueue *mq;
+	} gov;
+
+	struct {
+		bool enabled;
+		bool active;
+		double thres;
+		uint32_t hangover;
+		uint64_t last_voice;
+		uint64_t last_cn;
+	} vad;
 };
 
 
@@ -85,6 +127,176 @@ static void mcsource_destructor(void *arg)
 
 	src->module   = mem_deref(src->module);
 	src->device   = mem_deref(src->device);
+	src->gov.mq   = mem_deref(src->gov.mq);
+}
+
+
+/**
+ * Update the encoder bitrate
+ *
+ * @param src     Multicast source object
+ * @param bitrate Bitrate in [bit/s], 0 for codec default
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int encoder_update(struct mcsource *src, uint32_t bitrate)
+{
+	struct auenc_param prm;
+
+	if (!src->ac->encupdh)
+		return 0;
+
+	prm.bitrate = bitrate;
+	return src->ac->encupdh(&src->enc, src->ac, &prm, NULL);
+}
+
+
+/**
+ * Governor event handler, reports decisions from the main thread
+ *
+ * @param id   Governor level
+ * @param data Unused
+ * @param arg  Multicast source object
+ */
+static void governor_mqueue_handler(int id, void *data, void *arg)
+{
+	struct mcsource *src = arg;
+	uint32_t bitrate = src->gov.bitrate / govlevelv[id].brdiv;
+	(void) data;
+
+	info("multicast source: governor %s level=%d load=%u%% budget=%u%% "
+		"ptime=%u bitrate=%u\n", src->ac->name, id,
+		re_atomic_rlx(&src->gov.load), src->gov.budget,
+		govlevelv[id].ptime, bitrate);
+
+	module_event("multicast", "source governor", NULL, NULL,
+		"codec=%s level=%d load=%u budget=%u ptime=%u bitrate=%u",
+		src->ac->name, id, re_atomic_rlx(&src->gov.load),
+		src->gov.budget, govlevelv[id].ptime, bitrate);
+}
+
+
+/**
+ * Encoder governor, adapts frame size and bitrate to the CPU budget
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param src      Multicast source object
+ * @param enc_usec Encode time of the last frame in [us]
+ */
+static void governor_update(struct mcsource *src, uint64_t enc_usec)
+{
+	uint32_t level = src->gov.level;
+	uint32_t load;
+	size_t sz;
+
+	src->gov.enc_usec += enc_usec;
+	if (++src->gov.frames < GOV_FRAMES)
+		return;
+
+	load = (uint32_t)(src->gov.enc_usec * 100 /
+		((uint64_t)src->gov.frames * src->ptime * 1000));
+	re_atomic_rlx_set(&src->gov.load, load);
+	src->gov.enc_usec = 0;
+	src->gov.frames = 0;
+
+	if (load > src->gov.budget && level + 1 < RE_ARRAY_SIZE(govlevelv))
+		++level;
+	else if (load < src->gov.budget / 2 && level > 0)
+		--level;
+	else
+		return;
+
+	/* bitrate levels only with a configured bitrate */
+	if (!src->gov.bitrate && govlevelv[level].brdiv > 1)
+		return;
+
+	if (govlevelv[level].brdiv != govlevelv[src->gov.level].brdiv)
+		(void)encoder_update(src,
+			src->gov.bitrate / govlevelv[level].brdiv);
+
+	sz = aufmt_sample_size(src->src_fmt);
+	src->ptime = govlevelv[level].ptime;
+	src->psize = sz * (src->ausrc_prm.srate * src->ausrc_prm.ch *
+		src->ptime / 1000);
+	src->gov.level = level;
+
+	(void)mqueue_push(src->gov.mq, (int)level, NULL);
+}
+
+
+/**
+ * Advance the RTP timestamp by the given number of samples
+ *
+ * @param src   Multicast source object
+ * @param sampc Samplecounter
+ */
+static void ts_advance(struct mcsource *src, size_t sampc)
+{
+	size_t sampc_rtp = sampc * src->ac->crate / src->ac->srate;
+
+	src->ts_ext += (uint32_t)(sampc_rtp / src->ac->ch);
+}
+
+
+/**
+ * Send a RFC 3389 comfort noise packet to keep the stream alive during DTX
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param src   Multicast source object
+ * @param level Audio level in [dBov]
+ */
+static void send_cn(struct mcsource *src, double level)
+{
+	uint8_t noise = level < -127.0 ? 127 :
+		level > 0.0 ? 0 : (uint8_t)-level;
+
+	src->mb->pos = src->mb->end = STREAM_PRESZ;
+	(void)mbuf_write_u8(src->mb, noise);
+	src->mb->pos = STREAM_PRESZ;
+
+	(void)src->sendh(0, false, true, src->ts_ext & 0xffffffff, src->mb,
+		src->arg);
+}
+
+
+/**
+ * Voice activity gate, sends comfort noise instead of silent frames
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param src Multicast source object
+ * @param af  Audio frame
+ *
+ * @return true if the frame has to be sent, false in silence
+ */
+static bool vad_gate(struct mcsource *src, struct auframe *af)
+{
+	uint64_t now = tmr_jiffies();
+	double level = auframe_level(af);
+
+	if (level >= src->vad.thres) {
+		/* first packet of a talkspurt */
+		if (!src->vad.active)
+			src->marker = true;
+
+		src->vad.active = true;
+		src->vad.last_voice = now;
+		return true;
+	}
+
+	if (src->vad.active && now - src->vad.last_voice < src->vad.hangover)
+		return true;
+
+	if (src->vad.active || now - src->vad.last_cn >= DTX_KEEPALIVE) {
+		send_cn(src, level);
+		src->vad.last_cn = now;
+	}
+
+	src->vad.active = false;
+	ts_advance(src, af->sampc);
+	return false;
 }
 
 
@@ -100,12 +312,11 @@ static void mcsource_destructor(void *arg)
 static void encode_rtp_send(struct mcsource *src, uint16_t *sampv,
 	size_t sampc)
 {
-	size_t frame_size;
-	size_t sampc_rtp;
 	size_t len;
 
 	size_t ext_len = 0;
 	uint32_t ts_delta = 0;
+	uint64_t t = 0;
 	int err = 0;
 
 	if (!src->ac || !src->ac->ench)
@@ -113,10 +324,16 @@ static void encode_rtp_send(struct mcsource *src, uint16_t *sampv,
 
 	src->mb->pos = src->mb->end = STREAM_PRESZ;
 
+	if (src->gov.budget)
+		t = tmr_jiffies_usec();
+
 	len = mbuf_get_space(src->mb);
 	err = src->ac->ench(src->enc, &src->marker, mbuf_buf(src->mb), &len,
 		src->enc_fmt, sampv, sampc);
 
+	if (src->gov.budget)
+		governor_update(src, tmr_jiffies_usec() - t);
+
 	if ((err & 0xffff0000) == 0x00010000) {
 		ts_delta = err & 0xffff;
 		sampc = 0;
@@ -134,7 +351,7 @@ static void encode_rtp_send(struct mcsource *src, uint16_t *sampv,
 		uint32_t rtp_ts = src->ts_ext & 0xffffffff;
 
 		if (len) {
-			err = src->sendh(ext_len, src->marker,
+			err = src->sendh(ext_len, src->marker, false,
 				rtp_ts, src->mb, src->arg);
 			if (err)
 				goto out;
@@ -146,9 +363,7 @@ static void encode_rtp_send(struct mcsource *src, uint16_t *sampv,
 		}
 	}
 
-	sampc_rtp = sampc * src->ac->crate / src->ac->srate;
-	frame_size = sampc_rtp / src->ac->ch;
-	src->ts_ext += (uint32_t) frame_size;
+	ts_advance(src, sampc);
 
   out:
 	src->marker = false;
@@ -242,6 +457,9 @@ static void poll_aubuf_tx(struct mcsource *src)
 	if (err)
 		warning("multicast source: aufilter encode (%m)\n", err);
 
+	if (src->vad.enabled && !vad_gate(src, &af))
+		return;
+
 	encode_rtp_send(src, af.sampv, af.sampc);
 }
 
@@ -310,9 +528,15 @@ static int tx_thread(void *arg)
 	struct mcsource *src = arg;
 	uint64_t ts = 0;
 
+	(void)mcthread_apply(MCTHREAD_TX);
+
 	while (re_atomic_rlx(&src->thr.run)) {
 		uint64_t now;
+		uint64_t t = tmr_jiffies_usec();
+
 		sys_msleep(4);
+		now = tmr_jiffies_usec() - t;
+		mcthread_latency(MCTHREAD_TX, now > 4000 ? now - 4000 : 0);
 
 		if (!src->aubuf_started)
 			continue;
@@ -544,17 +768,22 @@ int mcsource_start(struct mcsource **srcp, const struct aucodec *ac,
 		goto out;
 
 	src->ac = ac;
-	if (src->ac->encupdh) {
-		struct auenc_param prm;
-
-		prm.bitrate = 0;
-
-		err = src->ac->encupdh(&src->enc, src->ac, &prm, NULL);
-		if (err) {
-			warning ("multicast source: alloc encoder (%m)\n",
-				err);
+	src->vad.enabled  = multicast_vad();
+	src->vad.thres    = multicast_vad_threshold();
+	src->vad.hangover = multicast_vad_hangover();
+	src->gov.budget  = multicast_cpu_budget();
+	src->gov.bitrate = multicast_bitrate();
+	if (src->gov.budget) {
+		err = mqueue_alloc(&src->gov.mq, governor_mqueue_handler,
+			src);
+		if (err)
 			goto out;
-		}
+	}
+
+	err = encoder_update(src, src->gov.bitrate);
+	if (err) {
+		warning ("multicast source: alloc encoder (%m)\n", err);
+		goto out;
 	}
 
 	err = aufilt_setup(src, baresip_aufiltl());
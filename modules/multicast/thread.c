@@ -0,0 +1,317 @@
+/**
+ * @file thread.c  Real-time settings of the multicast threads
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#ifdef LINUX
+#define _GNU_SOURCE 1
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <re_atomic.h>
+#include <re.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcthread"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+enum {
+	HIST_BUCKETS = 8,
+	MAX_CPUS     = 64,
+};
+
+
+/** Upper limits of the wakeup latency histogram buckets in [us] */
+static const uint64_t hist_limitv[HIST_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2000, 5000
+};
+
+
+static const char *type_namev[MCTHREAD_MAX] = {
+	"tx",
+	"decode",
+};
+
+
+/**
+ * Multicast thread configuration and wakeup latency statistics
+ */
+struct mcthread {
+	struct pl policy;
+	char policy_str[8];
+	uint32_t prio;
+	uint64_t cpumask;
+	bool mlock;
+	bool locked;          /**< Memory locked by this module only */
+
+	struct {
+		RE_ATOMIC uint64_t bucketv[HIST_BUCKETS];
+		RE_ATOMIC uint64_t max;
+		RE_ATOMIC uint64_t n;
+	} histv[MCTHREAD_MAX];
+};
+
+
+static struct mcthread mcthread;
+
+
+/**
+ * Decode a CPU list <CPU>[,<CPU>...] into a CPU mask
+ *
+ * @param pl   CPU list
+ * @param mask CPU mask
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int decode_cpumask(const struct pl *pl, uint64_t *mask)
+{
+	const char *p = pl->p;
+	const char *end = pl->p + pl->l;
+	struct pl cpu;
+	uint32_t n;
+
+	*mask = 0;
+	while (p < end) {
+		cpu.p = p;
+		while (p < end && *p != ',')
+			++p;
+
+		cpu.l = p - cpu.p;
+		if (re_regex(cpu.p, cpu.l, "^[0-9]+$", NULL))
+			return EINVAL;
+
+		n = pl_u32(&cpu);
+		if (n >= MAX_CPUS)
+			return EINVAL;
+
+		*mask |= (uint64_t)1 << n;
+		if (p < end)
+			++p;
+	}
+
+	return *mask ? 0 : EINVAL;
+}
+
+
+/**
+ * Apply the configured scheduling policy, priority and CPU affinity to the
+ * calling thread
+ *
+ * @param type Thread type
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcthread_apply(enum mcthread_type type)
+{
+	int err = 0;
+#ifdef LINUX
+	struct sched_param param;
+	int policy = -1;
+
+	if (!pl_strcasecmp(&mcthread.policy, "fifo"))
+		policy = SCHED_FIFO;
+	else if (!pl_strcasecmp(&mcthread.policy, "rr"))
+		policy = SCHED_RR;
+
+	if (policy != -1) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = (int)mcthread.prio;
+		err = pthread_setschedparam(pthread_self(), policy, &param);
+		if (err) {
+			warning("multicast: %s thread scheduling %r/%u "
+				"(%m)\n", type_namev[type], &mcthread.policy,
+				mcthread.prio, err);
+		}
+	}
+
+	if (mcthread.cpumask) {
+		cpu_set_t set;
+		int e;
+
+		CPU_ZERO(&set);
+		for (int i = 0; i < MAX_CPUS; i++) {
+			if (mcthread.cpumask & ((uint64_t)1 << i))
+				CPU_SET(i, &set);
+		}
+
+		e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (e) {
+			warning("multicast: %s thread affinity (%m)\n",
+				type_namev[type], e);
+			err = e;
+		}
+	}
+#else
+	(void) type;
+#endif
+
+	return err;
+}
+
+
+/**
+ * Add a wakeup latency sample of a thread
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param type Thread type
+ * @param usec Wakeup latency in [us]
+ */
+void mcthread_latency(enum mcthread_type type, uint64_t usec)
+{
+	size_t i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(hist_limitv); i++) {
+		if (usec < hist_limitv[i])
+			break;
+	}
+
+	re_atomic_rlx_add(&mcthread.histv[type].bucketv[i], 1);
+	re_atomic_rlx_add(&mcthread.histv[type].n, 1);
+	if (usec > re_atomic_rlx(&mcthread.histv[type].max))
+		re_atomic_rlx_set(&mcthread.histv[type].max, usec);
+}
+
+
+/**
+ * Print thread settings and wakeup latency histograms
+ *
+ * @param pf Printer
+ */
+void mcthread_print(struct re_printf *pf)
+{
+	int t;
+	size_t i;
+
+	re_hprintf(pf, "Multicast Threads: policy=%s prio=%u cpus=0x%llx "
+		"mlock=%s\n", mcthread.policy_str, mcthread.prio,
+		mcthread.cpumask, mcthread.locked ? "yes" : "no");
+
+	for (t = 0; t < MCTHREAD_MAX; t++) {
+		uint64_t n = re_atomic_rlx(&mcthread.histv[t].n);
+
+		if (!n)
+			continue;
+
+		re_hprintf(pf, "   %s wakeup latency (n=%llu max=%lluus):",
+			type_namev[t], n,
+			re_atomic_rlx(&mcthread.histv[t].max));
+
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			uint64_t b = re_atomic_rlx(
+				&mcthread.histv[t].bucketv[i]);
+
+			if (i < RE_ARRAY_SIZE(hist_limitv))
+				re_hprintf(pf, " <%llu=%llu", hist_limitv[i],
+					b);
+			else
+				re_hprintf(pf, " >=%llu=%llu",
+					hist_limitv[i - 1], b);
+		}
+
+		re_hprintf(pf, "\n");
+	}
+}
+
+
+#ifdef LINUX
+/**
+ * Check if memory of the process is locked, e.g. by another module
+ *
+ * @return true if locked, otherwise false
+ */
+static bool vm_locked(void)
+{
+	unsigned long kb = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmLck: %lu", &kb) == 1)
+			break;
+	}
+
+	(void)fclose(f);
+
+	return kb > 0;
+}
+#endif
+
+
+/**
+ * Read the thread configuration and lock the memory if configured
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcthread_init(void)
+{
+	struct pl pl;
+	int err = 0;
+
+	memset(&mcthread, 0, sizeof(mcthread));
+	str_ncpy(mcthread.policy_str, "other", sizeof(mcthread.policy_str));
+
+	(void)conf_get_str(conf_cur(), "multicast_thread_policy",
+		mcthread.policy_str, sizeof(mcthread.policy_str));
+	pl_set_str(&mcthread.policy, mcthread.policy_str);
+
+	(void)conf_get_u32(conf_cur(), "multicast_thread_prio",
+		&mcthread.prio);
+	(void)conf_get_bool(conf_cur(), "multicast_mlockall",
+		&mcthread.mlock);
+
+	if (0 == conf_get(conf_cur(), "multicast_thread_affinity", &pl)) {
+		err = decode_cpumask(&pl, &mcthread.cpumask);
+		if (err) {
+			warning("multicast: invalid thread affinity '%r'\n",
+				&pl);
+			return err;
+		}
+	}
+
+#ifdef LINUX
+	if (mcthread.mlock) {
+		/* memory locked by others must stay locked at module close */
+		const bool locked = vm_locked();
+
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			err = errno;
+			warning("multicast: mlockall failed (%m)\n", err);
+			return err;
+		}
+
+		mcthread.locked = !locked;
+	}
+#endif
+
+	return err;
+}
+
+
+/**
+ * Terminate the thread settings, munlockall() is only called if the memory
+ * was not locked before this module locked it
+ */
+void mcthread_terminate(void)
+{
+#ifdef LINUX
+	if (mcthread.locked)
+		(void)munlockall();
+#endif
+
+	mcthread.locked = false;
+}
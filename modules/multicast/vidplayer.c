@@ -0,0 +1,230 @@
+/**
+ * @file multicast/vidplayer.c
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+
+#define DEBUG_MODULE "mcvidplayer"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+/**
+ * Multicast video player struct
+ *
+ * Contains the video decoder and the video display
+ */
+struct mcvidplayer {
+	struct config_video *cfg;
+
+	const struct vidcodec *vc;
+	struct viddec_state *dec;
+	const struct vidisp *vd;
+	struct vidisp_st *vidisp;
+	struct list filterl;
+};
+
+
+static struct mcvidplayer *vplayer;
+
+
+static void mcvidplayer_destructor(void *arg)
+{
+	struct mcvidplayer *vp = arg;
+
+	mem_deref(vp->vidisp);
+	mem_deref(vp->dec);
+	list_flush(&vp->filterl);
+}
+
+
+/**
+ * Setup all available video filter for the decoder
+ *
+ * @param vp Multicast video player
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int vidfilt_setup(struct mcvidplayer *vp)
+{
+	struct vidfilt_prm prm;
+	struct le *le;
+	int err = 0;
+
+	prm.width  = 0;
+	prm.height = 0;
+	prm.fmt    = -1;
+	prm.fps    = .0;
+
+	LIST_FOREACH(baresip_vidfiltl(), le) {
+		struct vidfilt *vf = le->data;
+		void *ctx = NULL;
+
+		err = vidfilt_dec_append(&vp->filterl, &ctx, vf, &prm, NULL);
+		if (err) {
+			warning("multicast vidplayer: video-filter '%s' "
+				"failed (%m)\n", vf->name, err);
+			break;
+		}
+	}
+
+	return err;
+}
+
+
+/**
+ * Decode the payload of the RTP packet and display the frame
+ *
+ * @param hdr RTP header
+ * @param mb  RTP payload
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcvidplayer_decode(const struct rtp_header *hdr, struct mbuf *mb)
+{
+	struct viddec_packet pkt;
+	struct vidframe frame;
+	uint64_t timestamp;
+	struct le *le;
+	int err = 0;
+
+	if (!vplayer || !hdr || !mb)
+		return EINVAL;
+
+	if (!vplayer->dec)
+		return 0;
+
+	pkt.intra = false;
+	pkt.hdr = hdr;
+	pkt.timestamp = video_calc_timebase_timestamp(hdr->ts);
+	pkt.mb = mb;
+
+	frame.data[0] = NULL;
+	err = vplayer->vc->dech(vplayer->dec, &frame, &pkt);
+	if (err) {
+		debug("multicast vidplayer: %s decode (%m)\n",
+			vplayer->vc->name, err);
+		return err;
+	}
+
+	if (!vidframe_isvalid(&frame))
+		return 0;
+
+	timestamp = pkt.timestamp;
+	for (le = vplayer->filterl.head; le; le = le->next) {
+		struct vidfilt_dec_st *st = le->data;
+
+		if (st->vf->dech)
+			err |= st->vf->dech(st, &frame, &timestamp);
+	}
+
+	if (err)
+		warning("multicast vidplayer: video-filter (%m)\n", err);
+
+	if (!vplayer->vidisp || !vplayer->vd->disph)
+		return 0;
+
+	err = vplayer->vd->disph(vplayer->vidisp, "Multicast", &frame,
+		timestamp);
+	if (err == ENODEV) {
+		info("multicast vidplayer: video-display was closed\n");
+		vplayer->vidisp = mem_deref(vplayer->vidisp);
+	}
+
+	return err;
+}
+
+
+/**
+ * Allocate and start a video player for the multicast
+ *
+ * @note singleton
+ *
+ * @param vc Video codec
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcvidplayer_start(const struct vidcodec *vc)
+{
+	struct config_video *cfg = &conf_config()->video;
+	struct vidisp_prm prm;
+	int err = 0;
+
+	if (!vc || !vc->dech)
+		return EINVAL;
+
+	vplayer = mem_deref(vplayer);
+	vplayer = mem_zalloc(sizeof(*vplayer), mcvidplayer_destructor);
+	if (!vplayer)
+		return ENOMEM;
+
+	vplayer->cfg = cfg;
+	vplayer->vc  = vc;
+
+	if (vc->decupdh) {
+		err = vc->decupdh(&vplayer->dec, vc, NULL, NULL);
+		if (err) {
+			warning("multicast vidplayer: alloc decoder (%m)\n",
+				err);
+			goto out;
+		}
+	}
+
+	err = vidfilt_setup(vplayer);
+	if (err)
+		goto out;
+
+	prm.fullscreen = cfg->fullscreen;
+	err = vidisp_alloc(&vplayer->vidisp, baresip_vidispl(),
+		cfg->disp_mod, &prm, cfg->disp_dev, NULL, vplayer);
+	if (err) {
+		warning("multicast vidplayer: start of %s.%s failed (%m)\n",
+			cfg->disp_mod, cfg->disp_dev, err);
+		goto out;
+	}
+
+	vplayer->vd = vidisp_find(baresip_vidispl(), cfg->disp_mod);
+
+  out:
+	if (err)
+		vplayer = mem_deref(vplayer);
+
+	return err;
+}
+
+
+/**
+ * Stop multicast video player
+ */
+void mcvidplayer_stop(void)
+{
+	vplayer = mem_deref(vplayer);
+}
+
+
+/**
+ * Initialize everything needed for the video player beforhand
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcvidplayer_init(void)
+{
+	return 0;
+}
+
+
+/**
+ * Terminate everything needed for the video player afterwards
+ *
+ */
+void mcvidplayer_terminate(void)
+{
+	vplayer = mem_deref(vplayer);
+}
@@ -0,0 +1,540 @@
+/**
+ * @file vidsource.c
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcvidsource"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+/**
+ * Shared multicast video source
+ *
+ * One video source is opened for all video sender. Each codec is encoded
+ * once and the resulting RTP payload is sent by all sender of this codec.
+ */
+struct vidshared {
+	struct config_video *cfg;
+	struct vidsrc_st *vidsrc;
+	struct vidsrc_prm prm;
+	struct vidsz size;
+	struct list filtl;
+	struct list encl;
+	struct vidframe *frame;
+	struct tmr tmr_key;
+	mtx_t *mtx;
+};
+
+
+/**
+ * Multicast video encoder struct
+ *
+ * Contains the encoder for one video codec and all sender using it
+ */
+struct mcvidenc {
+	struct le le;
+	const struct vidcodec *vc;
+	struct videnc_state *enc;
+	struct mbuf *mb;
+	struct list srcl;
+	bool update;           /**< Encode the next frame as key-frame */
+};
+
+
+/**
+ * Multicast video source struct
+ *
+ * Connects a video sender to the encoder of the shared video source
+ */
+struct mcvidsource {
+	struct le le;
+	struct mcvidenc *venc;
+
+	mcsender_send_h *sendh;
+	void *arg;
+};
+
+
+static struct vidshared *vshared;
+
+
+static void vidshared_destructor(void *arg)
+{
+	struct vidshared *vs = arg;
+
+	tmr_cancel(&vs->tmr_key);
+	vs->vidsrc = mem_deref(vs->vidsrc);
+
+	mtx_lock(vs->mtx);
+	list_flush(&vs->encl);
+	list_flush(&vs->filtl);
+	vs->frame = mem_deref(vs->frame);
+	mtx_unlock(vs->mtx);
+
+	vs->mtx = mem_deref(vs->mtx);
+}
+
+
+static void mcvidenc_destructor(void *arg)
+{
+	struct mcvidenc *venc = arg;
+
+	list_unlink(&venc->le);
+	venc->enc = mem_deref(venc->enc);
+	venc->mb  = mem_deref(venc->mb);
+}
+
+
+static void mcvidsource_destructor(void *arg)
+{
+	struct mcvidsource *src = arg;
+
+	if (!vshared || !src->venc)
+		return;
+
+	mtx_lock(vshared->mtx);
+	list_unlink(&src->le);
+	if (list_isempty(&src->venc->srcl))
+		mem_deref(src->venc);
+	mtx_unlock(vshared->mtx);
+
+	if (list_isempty(&vshared->encl))
+		vshared = mem_deref(vshared);
+}
+
+
+/**
+ * Video encoder comparison
+ *
+ * @param le  List element (mcvidenc)
+ * @param arg Argument     (vidcodec)
+ *
+ * @return true if mcvidenc->vc == vidcodec
+ */
+static bool mcvidenc_vc_cmp(struct le *le, void *arg)
+{
+	struct mcvidenc *venc = le->data;
+
+	return venc->vc == arg;
+}
+
+
+/**
+ * Send one RTP payload via all sender of the encoder
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param venc    Multicast video encoder
+ * @param marker  RTP marker
+ * @param rtp_ts  RTP timestamp
+ * @param hdr     Payload header
+ * @param hdr_len Payload header length
+ * @param pld     Payload
+ * @param pld_len Payload length
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int venc_send(struct mcvidenc *venc, bool marker, uint64_t rtp_ts,
+	const uint8_t *hdr, size_t hdr_len,
+	const uint8_t *pld, size_t pld_len)
+{
+	struct le *le;
+	int err = 0;
+
+	venc->mb->pos = venc->mb->end = STREAM_PRESZ;
+	if (hdr_len)
+		err = mbuf_write_mem(venc->mb, hdr, hdr_len);
+
+	err |= mbuf_write_mem(venc->mb, pld, pld_len);
+	if (err)
+		return err;
+
+	LIST_FOREACH(&venc->srcl, le) {
+		struct mcvidsource *src = le->data;
+
+		venc->mb->pos = STREAM_PRESZ;
+		err |= src->sendh(0, marker, false, (uint32_t)rtp_ts,
+			venc->mb, src->arg);
+	}
+
+	return err;
+}
+
+
+/**
+ * Video encoder packet handler
+ *
+ * @param marker  RTP marker
+ * @param rtp_ts  RTP timestamp
+ * @param hdr     Payload header
+ * @param hdr_len Payload header length
+ * @param pld     Payload
+ * @param pld_len Payload length
+ * @param arg     Multicast video encoder
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int packet_handler(bool marker, uint64_t rtp_ts,
+	const uint8_t *hdr, size_t hdr_len,
+	const uint8_t *pld, size_t pld_len,
+	const struct video *arg)
+{
+	struct mcvidenc *venc = (struct mcvidenc *)arg;
+
+	return venc_send(venc, marker, rtp_ts, hdr, hdr_len, pld, pld_len);
+}
+
+
+static int packet_handler_h264(bool marker, uint64_t rtp_ts,
+	const uint8_t *hdr, size_t hdr_len,
+	const uint8_t *pld, size_t pld_len,
+	void *arg)
+{
+	return venc_send(arg, marker, rtp_ts, hdr, hdr_len, pld, pld_len);
+}
+
+
+/**
+ * Video source frame handler
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param frame     Video frame
+ * @param timestamp Frame timestamp in VIDEO_TIMEBASE units
+ * @param arg       Shared video source
+ */
+static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
+	void *arg)
+{
+	struct vidshared *vs = arg;
+	struct le *le;
+	int err = 0;
+
+	mtx_lock(vs->mtx);
+
+	if (frame->fmt != (enum vidfmt)vs->cfg->enc_fmt) {
+		if (vs->frame && !vidsz_cmp(&vs->frame->size, &frame->size))
+			vs->frame = mem_deref(vs->frame);
+
+		if (!vs->frame && vidframe_alloc(&vs->frame,
+			vs->cfg->enc_fmt, &frame->size))
+			goto out;
+
+		vidconv(vs->frame, frame, 0);
+		frame = vs->frame;
+	}
+
+	LIST_FOREACH(&vs->filtl, le) {
+		struct vidfilt_enc_st *st = le->data;
+
+		if (st->vf->ench)
+			err |= st->vf->ench(st, frame, &timestamp);
+	}
+
+	if (err)
+		warning("multicast vidsource: video-filter (%m)\n", err);
+
+	LIST_FOREACH(&vs->encl, le) {
+		struct mcvidenc *venc = le->data;
+
+		if (list_isempty(&venc->srcl))
+			continue;
+
+		err = venc->vc->ench(venc->enc, venc->update, frame,
+			timestamp);
+		venc->update = false;
+		if (err)
+			warning("multicast vidsource: %s encode (%m)\n",
+				venc->vc->name, err);
+	}
+
+ out:
+	mtx_unlock(vs->mtx);
+}
+
+
+/**
+ * Video source packet handler for pre-encoded H.264 sources
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param packet Video packet
+ * @param arg    Shared video source
+ */
+static void vidsrc_packet_handler(struct vidpacket *packet, void *arg)
+{
+	struct vidshared *vs = arg;
+	uint64_t rtp_ts;
+	struct le *le;
+
+	rtp_ts = video_calc_rtp_timestamp_fix(packet->timestamp);
+
+	mtx_lock(vs->mtx);
+	LIST_FOREACH(&vs->encl, le) {
+		struct mcvidenc *venc = le->data;
+
+		if (0 != str_casecmp(venc->vc->name, "H264"))
+			continue;
+
+		(void)h264_packetize(rtp_ts, packet->buf, packet->size,
+			VIDEO_PKTSIZE, packet_handler_h264, venc);
+	}
+	mtx_unlock(vs->mtx);
+}
+
+
+/**
+ * Request a key-frame from all encoders, so that a receiver that joins or
+ * switches streams does not wait for the end of the codec's GOP
+ *
+ * @param arg Shared video source
+ */
+static void keyframe_handler(void *arg)
+{
+	struct vidshared *vs = arg;
+	struct le *le;
+
+	tmr_start(&vs->tmr_key, multicast_vid_keyint(), keyframe_handler, vs);
+
+	mtx_lock(vs->mtx);
+	LIST_FOREACH(&vs->encl, le) {
+		struct mcvidenc *venc = le->data;
+
+		venc->update = true;
+	}
+	mtx_unlock(vs->mtx);
+}
+
+
+/**
+ * Setup all available video filter for the encoder
+ *
+ * @param vs Shared video source
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int vidfilt_setup(struct vidshared *vs)
+{
+	struct vidfilt_prm prm;
+	struct le *le;
+	int err = 0;
+
+	prm.width  = vs->size.w;
+	prm.height = vs->size.h;
+	prm.fmt    = vs->cfg->enc_fmt;
+	prm.fps    = vs->cfg->fps;
+
+	LIST_FOREACH(baresip_vidfiltl(), le) {
+		struct vidfilt *vf = le->data;
+		void *ctx = NULL;
+
+		err = vidfilt_enc_append(&vs->filtl, &ctx, vf, &prm, NULL);
+		if (err) {
+			warning("multicast vidsource: video-filter '%s' "
+				"failed (%m)\n", vf->name, err);
+			break;
+		}
+	}
+
+	return err;
+}
+
+
+/**
+ * Allocate the shared video source
+ *
+ * @param vsp Shared video source ptr
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int vidshared_alloc(struct vidshared **vsp)
+{
+	struct vidshared *vs;
+	int err;
+
+	vs = mem_zalloc(sizeof(*vs), vidshared_destructor);
+	if (!vs)
+		return ENOMEM;
+
+	tmr_init(&vs->tmr_key);
+	vs->cfg = &conf_config()->video;
+	vs->size.w = vs->cfg->width;
+	vs->size.h = vs->cfg->height;
+	vs->prm.fps = vs->cfg->fps;
+	vs->prm.fmt = vs->cfg->enc_fmt;
+
+	err = mutex_alloc(&vs->mtx);
+	if (err)
+		goto out;
+
+	err = vidfilt_setup(vs);
+	if (err)
+		goto out;
+
+	err = vidsrc_alloc(&vs->vidsrc, baresip_vidsrcl(), vs->cfg->src_mod,
+		&vs->prm, &vs->size, NULL, vs->cfg->src_dev,
+		vidsrc_frame_handler, vidsrc_packet_handler, NULL, vs);
+	if (err) {
+		warning("multicast vidsource: start of %s.%s failed (%m)\n",
+			vs->cfg->src_mod, vs->cfg->src_dev, err);
+		goto out;
+	}
+
+	if (multicast_vid_keyint())
+		tmr_start(&vs->tmr_key, multicast_vid_keyint(),
+			keyframe_handler, vs);
+
+	info("multicast vidsource: %s.%s started %u x %u at %.2f fps\n",
+		vs->cfg->src_mod, vs->cfg->src_dev, vs->size.w, vs->size.h,
+		vs->prm.fps);
+
+  out:
+	if (err)
+		mem_deref(vs);
+	else
+		*vsp = vs;
+
+	return err;
+}
+
+
+/**
+ * Allocate a video encoder for the shared video source
+ *
+ * @param vencp Multicast video encoder ptr
+ * @param vc    Video codec
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mcvidenc_alloc(struct mcvidenc **vencp, const struct vidcodec *vc)
+{
+	struct mcvidenc *venc;
+	struct videnc_param prm;
+	int err = 0;
+
+	venc = mem_zalloc(sizeof(*venc), mcvidenc_destructor);
+	if (!venc)
+		return ENOMEM;
+
+	venc->vc = vc;
+	venc->mb = mbuf_alloc(STREAM_PRESZ + VIDEO_PKTSIZE);
+	if (!venc->mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	prm.fps     = vshared->cfg->fps;
+	prm.pktsize = VIDEO_PKTSIZE;
+	prm.bitrate = vshared->cfg->bitrate;
+	prm.max_fs  = -1;
+
+	err = vc->encupdh(&venc->enc, vc, &prm, NULL, packet_handler,
+		(struct video *)venc);
+	if (err) {
+		warning("multicast vidsource: alloc encoder %s (%m)\n",
+			vc->name, err);
+		goto out;
+	}
+
+	list_append(&vshared->encl, &venc->le, venc);
+
+  out:
+	if (err)
+		mem_deref(venc);
+	else
+		*vencp = venc;
+
+	return err;
+}
+
+
+/**
+ * Start multicast video source
+ *
+ * @param srcp  Multicast video source ptr
+ * @param vc    Video codec
+ * @param sendh Send handler ptr
+ * @param arg   Send handler Argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcvidsource_start(struct mcvidsource **srcp, const struct vidcodec *vc,
+	mcsender_send_h *sendh, void *arg)
+{
+	struct mcvidsource *src;
+	struct mcvidenc *venc = NULL;
+	struct le *le;
+	int err = 0;
+
+	if (!srcp || !vc || !sendh)
+		return EINVAL;
+
+	if (!vc->encupdh || !vc->ench)
+		return ENOTSUP;
+
+	if (!vshared) {
+		err = vidshared_alloc(&vshared);
+		if (err)
+			return err;
+	}
+
+	src = mem_zalloc(sizeof(*src), mcvidsource_destructor);
+	if (!src)
+		return ENOMEM;
+
+	src->sendh = sendh;
+	src->arg   = arg;
+
+	mtx_lock(vshared->mtx);
+	le = list_apply(&vshared->encl, true, mcvidenc_vc_cmp, (void *)vc);
+	if (le)
+		venc = le->data;
+	else
+		err = mcvidenc_alloc(&venc, vc);
+
+	if (!err) {
+		src->venc = venc;
+		venc->update = true;
+		list_append(&venc->srcl, &src->le, src);
+	}
+	mtx_unlock(vshared->mtx);
+
+	if (err)
+		mem_deref(src);
+	else
+		*srcp = src;
+
+	if (list_isempty(&vshared->encl))
+		vshared = mem_deref(vshared);
+
+	return err;
+}
+
+
+/**
+ * Initialize everything needed for the video source beforhand
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcvidsource_init(void)
+{
+	return 0;
+}
+
+
+/**
+ * Terminate everything needed for the video source afterwards
+ *
+ */
+void mcvidsource_terminate(void)
+{
+	vshared = mem_deref(vshared);
+}
@@ -5,10 +5,12 @@
  */
 #define _DEFAULT_SOURCE 1
 #define _BSD_SOURCE 1
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <re.h>
 #include <rem.h>
+#include <re_atomic.h>
 #include <baresip.h>
 
 
@@ -29,11 +31,46 @@
  \verbatim
   baresip -e"/vidloop h264"
  \endverbatim
+ *
+ * Headless benchmark of 600 frames, from a synthetic NV12 source:
+ \verbatim
+  baresip -e"/vidloop_bench h264 600 nv12"
+ \endverbatim
  */
 
 
 enum {
-	VIDEO_SRATE = 90000
+	VIDEO_SRATE = 90000,
+	DISP_BUFS   = 3,
+	DISP_FRESH  = 0x4,   /* the middle buffer has a new frame */
+	PKT_BUFSZ   = 2048,  /* initial size of the packet buffer */
+	BENCH_FRAMES     = 300,
+	BENCH_MAX_FRAMES = 100000,
+};
+
+
+enum bench_stage {
+	STAGE_CONV = 0,
+	STAGE_FILT,
+	STAGE_ENC,   /* encoder and packetizer */
+	STAGE_DEC,
+	STAGE_DISP,  /* decode filters and the display copy */
+	STAGE_N
+};
+
+
+static const char *stage_names[STAGE_N] = {
+	"vidconv", "filters", "encoder", "decoder", "display"
+};
+
+
+/** Benchmark state, per-frame time of every stage */
+struct bench {
+	uint32_t framec;
+	uint32_t n;
+	uint64_t usec;                 /* pipeline time of all frames */
+	uint64_t cur[STAGE_N];         /* usec, of the current frame  */
+	uint32_t *usecv[STAGE_N];
 };
 
 
@@ -55,6 +92,14 @@ struct timestamp_state {
 };
 
 
+/** Display buffer, one of the triple buffer */
+struct disp_buf {
+	struct vidframe *frame;
+	uint64_t timestamp;
+	uint64_t ts_handler;  /* usec */
+};
+
+
 /** Video loop */
 struct video_loop {
 	const struct vidcodec *vc_enc;
@@ -71,18 +116,23 @@ struct video_loop {
 	struct list filtdecl;
 	struct vstat stat;
 	struct tmr tmr_bw;
-	struct tmr tmr_display;
+	struct mqueue *mq_display;
 	struct tmr tmr_update_src;
 	struct vidsz src_size;
 	struct vidsz disp_size;
 	enum vidfmt src_fmt;
 	enum vidfmt disp_fmt;
-	struct vidframe *frame;
-	uint64_t frame_timestamp;
-	mtx_t *frame_mutex;
-	bool new_frame;
+	struct disp_buf dispv[DISP_BUFS];
+	uint32_t disp_back;           /* owned by the producer      */
+	uint32_t disp_front;          /* owned by the display       */
+	RE_ATOMIC uint32_t disp_mid;  /* buffer index | DISP_FRESH */
 	uint64_t ts_start;      /* usec */
 	uint64_t ts_last;       /* usec */
+	uint64_t ts_handler;    /* usec, source frame handler entry */
+	struct mbuf *pkt_mb;    /* reused for every encoded packet */
+	struct vidframe *conv_frame;  /* reused for pixel-format conversion */
+	const char *conv_path;
+	struct bench *bench;    /* set in benchmark mode */
 	uint16_t seq;
 	bool need_conv;
 	bool started;
@@ -92,7 +142,16 @@ struct video_loop {
 		uint64_t src_frames;
 		uint64_t enc_bytes;
 		uint64_t enc_packets;
+		uint64_t pkt_allocs;
+		uint64_t dec_frames;
+		uint64_t conv_frames;
+		uint64_t conv_allocs;
+		uint64_t conv_usec;
+		uint64_t conv_max;      /* usec */
 		uint64_t disp_frames;
+		uint64_t disp_dropped;
+		uint64_t delay_sum;     /* usec, frame handler to display */
+		uint64_t delay_max;
 	} stats;
 
 	struct timestamp_state ts_src;
@@ -146,22 +205,48 @@ static void vidframe_clear(struct vidframe *frame)
 }
 
 
-static void display_handler(void *arg)
+/* add the time since *t to a benchmark stage of the current frame */
+static void bench_mark(struct video_loop *vl, enum bench_stage stage,
+		       uint64_t *t)
+{
+	uint64_t now;
+
+	if (!vl->bench)
+		return;
+
+	now = tmr_jiffies_usec();
+	vl->bench->cur[stage] += now - *t;
+	*t = now;
+}
+
+
+/* NOTE: usually (e.g. SDL2), video frame must be rendered from main thread */
+static void display_handler(int id, void *data, void *arg)
 {
 	struct video_loop *vl = arg;
+	struct disp_buf *db;
+	uint64_t delay;
+	uint32_t mid;
 	int err;
+	(void)id;
+	(void)data;
 
-	tmr_start(&vl->tmr_display, 10, display_handler, vl);
+	if (!vl->vidisp ||
+	    !(re_atomic_acq(&vl->disp_mid) & DISP_FRESH))
+		return;
 
-	mtx_lock(vl->frame_mutex);
-
-	if (!vl->new_frame)
-		goto out;
+	/* take the new frame, the display owns it until the next swap */
+	mid = re_atomic_acq_rel_xchg(&vl->disp_mid, vl->disp_front);
+	vl->disp_front = mid & ~DISP_FRESH;
+	db = &vl->dispv[vl->disp_front];
 
 	/* display frame */
 	err = vl->vd->disph(vl->vidisp, "Video Loop",
-			     vl->frame, vl->frame_timestamp);
-	vl->new_frame = false;
+			     db->frame, db->timestamp);
+
+	delay = tmr_jiffies_usec() - db->ts_handler;
+	vl->stats.delay_sum += delay;
+	vl->stats.delay_max = max(vl->stats.delay_max, delay);
 
 	if (err == ENODEV) {
 		info("vidloop: video-display was closed\n");
@@ -169,44 +254,50 @@ static void display_handler(void *arg)
 		vl->err = err;
 	}
 	++vl->stats.disp_frames;
-
- out:
-	mtx_unlock(vl->frame_mutex);
 }
 
 
 static int display(struct video_loop *vl, struct vidframe *frame,
 		   uint64_t timestamp)
 {
-	struct vidframe *frame_filt = NULL;
+	struct disp_buf *db = &vl->dispv[vl->disp_back];
 	struct le *le;
+	uint32_t mid;
 	int err = 0;
 
 	if (!vidframe_isvalid(frame))
 		return 0;
 
-	if (!list_isempty(&vl->filtdecl)) {
+	if (vl->disp_size.w && !vidsz_cmp(&vl->disp_size, &frame->size)) {
+
+		info("vidloop: resolution changed:  %u x %u\n",
+		     frame->size.w, frame->size.h);
+	}
 
-		/* Some video decoders keeps the displayed video frame
-		 * in memory and we should not write to that frame.
-		 */
+	/* the back buffer is owned by the producer, resize it here */
+	if (db->frame && (!vidsz_cmp(&db->frame->size, &frame->size) ||
+			  db->frame->fmt != frame->fmt))
+		db->frame = mem_deref(db->frame);
 
-		err = vidframe_alloc(&frame_filt, frame->fmt, &frame->size);
+	if (!db->frame) {
+		err = vidframe_alloc(&db->frame, frame->fmt, &frame->size);
 		if (err)
 			return err;
-
-		vidframe_copy(frame_filt, frame);
-
-		frame = frame_filt;
 	}
 
+	/* Some video decoders keeps the displayed video frame
+	 * in memory and we should not write to that frame.
+	 * The copy into the back buffer is the only one.
+	 */
+	vidframe_copy(db->frame, frame);
+
 	/* Process video frame through all Video Filters */
 	for (le = vl->filtdecl.head; le; le = le->next) {
 
 		struct vidfilt_dec_st *st = le->data;
 
 		if (st->vf->dech)
-			err |= st->vf->dech(st, frame, &timestamp);
+			err |= st->vf->dech(st, db->frame, &timestamp);
 	}
 
 	if (err) {
@@ -214,35 +305,52 @@ static int display(struct video_loop *vl, struct vidframe *frame,
 	}
 
 	/* save the displayed frame info */
-	vl->disp_size = frame->size;
-	vl->disp_fmt = frame->fmt;
+	vl->disp_size = db->frame->size;
+	vl->disp_fmt = db->frame->fmt;
+	db->timestamp = timestamp;
+	db->ts_handler = vl->ts_handler;
+
+	/* publish the back buffer and take over the middle buffer */
+	mid = re_atomic_acq_rel_xchg(&vl->disp_mid,
+				     vl->disp_back | DISP_FRESH);
+	vl->disp_back = mid & ~DISP_FRESH;
+
+	/* a pending wakeup displays the newest frame */
+	if (mid & DISP_FRESH)
+		++vl->stats.disp_dropped;
+	else if (vl->vidisp)
+		err = mqueue_push(vl->mq_display, 0, NULL);
 
-	mtx_lock(vl->frame_mutex);
+	return err;
+}
 
-	if (vl->frame && ! vidsz_cmp(&vl->frame->size, &frame->size)) {
 
-		info("vidloop: resolution changed:  %u x %u\n",
-		     frame->size.w, frame->size.h);
+/*
+ * The packets are decoded one at a time, so a single buffer is reused,
+ * unless the decoder kept a reference to it.
+ */
+static struct mbuf *packet_buf(struct video_loop *vl, size_t size)
+{
+	if (vl->pkt_mb && mem_nrefs(vl->pkt_mb) > 1)
+		vl->pkt_mb = mem_deref(vl->pkt_mb);
 
-		vl->frame = mem_deref(vl->frame);
-	}
+	if (!vl->pkt_mb) {
+		vl->pkt_mb = mbuf_alloc(max(size, (size_t)PKT_BUFSZ));
+		if (!vl->pkt_mb)
+			return NULL;
 
-	if (!vl->frame) {
-		err = vidframe_alloc(&vl->frame, frame->fmt, &frame->size);
-		if (err)
-			goto out;
+		++vl->stats.pkt_allocs;
 	}
+	else if (vl->pkt_mb->size < size) {
+		if (mbuf_resize(vl->pkt_mb, size))
+			return NULL;
 
-	vidframe_copy(vl->frame, frame);
-	vl->frame_timestamp = timestamp;
-	vl->new_frame = true;
-
- out:
-	mtx_unlock(vl->frame_mutex);
+		++vl->stats.pkt_allocs;
+	}
 
-	mem_deref(frame_filt);
+	mbuf_rewind(vl->pkt_mb);
 
-	return err;
+	return vl->pkt_mb;
 }
 
 
@@ -261,7 +369,7 @@ static int packet_handler(bool marker, uint64_t rtp_ts,
 
 	timestamp_state_update(&vl->ts_rtp, rtp_ts);
 
-	mb = mbuf_alloc(hdr_len + pld_len);
+	mb = packet_buf(vl, hdr_len + pld_len);
 	if (!mb)
 		return ENOMEM;
 
@@ -275,6 +383,7 @@ static int packet_handler(bool marker, uint64_t rtp_ts,
 
 	struct rtp_header rtp_hdr = {.m = marker, .seq = vl->seq++};
 	struct viddec_packet pkt  = {.mb = mb, .hdr = &rtp_hdr};
+	uint64_t t = tmr_jiffies_usec();
 
 	/* convert the RTP timestamp to VIDEO_TIMEBASE timestamp */
 	pkt.timestamp = video_calc_timebase_timestamp(rtp_ts);
@@ -283,6 +392,7 @@ static int packet_handler(bool marker, uint64_t rtp_ts,
 	vidframe_clear(&frame);
 	if (vl->vc_dec && vl->dec) {
 		err = vl->vc_dec->dech(vl->dec, &frame, &pkt);
+		bench_mark(vl, STAGE_DEC, &t);
 		if (err) {
 			warning("vidloop: codec decode: %m\n", err);
 			goto out;
@@ -292,12 +402,13 @@ static int packet_handler(bool marker, uint64_t rtp_ts,
 			++vl->stat.n_keyframe;
 	}
 
-	if (vidframe_isvalid(&frame))
+	if (vidframe_isvalid(&frame)) {
+		++vl->stats.dec_frames;
 		display(vl, &frame, pkt.timestamp);
+		bench_mark(vl, STAGE_DISP, &t);
+	}
 
  out:
-	mem_deref(mb);
-
 	return 0;
 }
 
@@ -314,19 +425,129 @@ static int packet_handler_h264(bool marker, uint64_t rtp_ts,
 }
 
 
+static void conv_yuyv_yuv420p(struct vidframe *dst,
+			      const struct vidframe *src)
+{
+	const unsigned w = src->size.w, h = src->size.h;
+
+	for (unsigned y = 0; y < h; y += 2) {
+
+		const uint8_t *restrict s0 = src->data[0] +
+			(size_t)y * src->linesize[0];
+		const uint8_t *restrict s1 = s0 + src->linesize[0];
+		uint8_t *restrict y0 = dst->data[0] +
+			(size_t)y * dst->linesize[0];
+		uint8_t *restrict y1 = y0 + dst->linesize[0];
+		uint8_t *restrict u = dst->data[1] +
+			(size_t)y / 2 * dst->linesize[1];
+		uint8_t *restrict v = dst->data[2] +
+			(size_t)y / 2 * dst->linesize[2];
+
+		for (unsigned x = 0; x < w; x++) {
+			y0[x] = s0[2*x];
+			y1[x] = s1[2*x];
+		}
+
+		for (unsigned x = 0; x < w / 2; x++) {
+			u[x] = (s0[4*x + 1] + s1[4*x + 1] + 1) >> 1;
+			v[x] = (s0[4*x + 3] + s1[4*x + 3] + 1) >> 1;
+		}
+	}
+}
+
+
+static void conv_nv12_yuv420p(struct vidframe *dst,
+			      const struct vidframe *src)
+{
+	const unsigned w = src->size.w, h = src->size.h;
+
+	for (unsigned y = 0; y < h; y++) {
+		memcpy(dst->data[0] + (size_t)y * dst->linesize[0],
+		       src->data[0] + (size_t)y * src->linesize[0], w);
+	}
+
+	for (unsigned y = 0; y < h / 2; y++) {
+
+		const uint8_t *restrict uv = src->data[1] +
+			(size_t)y * src->linesize[1];
+		uint8_t *restrict u = dst->data[1] +
+			(size_t)y * dst->linesize[1];
+		uint8_t *restrict v = dst->data[2] +
+			(size_t)y * dst->linesize[2];
+
+		for (unsigned x = 0; x < w / 2; x++) {
+			u[x] = uv[2*x];
+			v[x] = uv[2*x + 1];
+		}
+	}
+}
+
+
+/*
+ * Convert a source frame into the conversion frame, which is reused as
+ * long as the size and the format stay the same. The common capture
+ * formats have dedicated loops, everything else goes via vidconv().
+ */
+static int convert(struct video_loop *vl, const struct vidframe *frame)
+{
+	const enum vidfmt fmt = vl->cfg.enc_fmt;
+	const bool even = !(frame->size.w & 1) && !(frame->size.h & 1);
+	struct vidframe *dst;
+	uint64_t t0, usec;
+	int err;
+
+	dst = vl->conv_frame;
+	if (dst && (!vidsz_cmp(&dst->size, &frame->size) || dst->fmt != fmt))
+		vl->conv_frame = mem_deref(vl->conv_frame);
+
+	if (!vl->conv_frame) {
+		err = vidframe_alloc(&vl->conv_frame, fmt, &frame->size);
+		if (err)
+			return err;
+
+		++vl->stats.conv_allocs;
+	}
+
+	dst = vl->conv_frame;
+	t0 = tmr_jiffies_usec();
+
+	if (even && frame->fmt == VID_FMT_YUYV422 && fmt == VID_FMT_YUV420P) {
+		conv_yuyv_yuv420p(dst, frame);
+		vl->conv_path = "yuyv422 fast path";
+	}
+	else if (even && frame->fmt == VID_FMT_NV12 &&
+		 fmt == VID_FMT_YUV420P) {
+		conv_nv12_yuv420p(dst, frame);
+		vl->conv_path = "nv12 fast path";
+	}
+	else {
+		vidconv(dst, frame, 0);
+		vl->conv_path = "vidconv";
+	}
+
+	usec = tmr_jiffies_usec() - t0;
+	++vl->stats.conv_frames;
+	vl->stats.conv_usec += usec;
+	vl->stats.conv_max = max(vl->stats.conv_max, usec);
+
+	return 0;
+}
+
+
 static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 				 void *arg)
 {
 	struct video_loop *vl = arg;
-	struct vidframe *f2 = NULL;
 	struct le *le;
 	const uint64_t now = tmr_jiffies_usec();
+	uint64_t t = now;
 	int err = 0;
 
 	/* save the timing info */
-	if (!gvl->ts_start)
-		gvl->ts_start = now;
-	gvl->ts_last = now;
+	if (!vl->ts_start)
+		vl->ts_start = now;
+	vl->ts_last = now;
+	vl->ts_handler = now;
 
 	/* save the video frame info */
 	vl->src_size = frame->size;
@@ -347,12 +568,11 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 			vl->need_conv = true;
 		}
 
-		if (vidframe_alloc(&f2, vl->cfg.enc_fmt, &frame->size))
+		if (convert(vl, frame))
 			return;
 
-		vidconv(f2, frame, 0);
-
-		frame = f2;
+		frame = vl->conv_frame;
+		bench_mark(vl, STAGE_CONV, &t);
 	}
 
 	/* Process video frame through all Video Filters */
@@ -364,21 +584,28 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 			err |= st->vf->ench(st, frame, &timestamp);
 	}
 
+	bench_mark(vl, STAGE_FILT, &t);
+
 	if (vl->vc_enc && vl->enc) {
 
 		err = vl->vc_enc->ench(vl->enc, false, frame, timestamp);
-		if (err) {
+		if (err)
 			warning("vidloop: encoder error (%m)\n", err);
-			goto out;
+
+		/* the packets are decoded and displayed from the encoder */
+		if (vl->bench) {
+			struct bench *b = vl->bench;
+
+			bench_mark(vl, STAGE_ENC, &t);
+			b->cur[STAGE_ENC] -= b->cur[STAGE_DEC] +
+				b->cur[STAGE_DISP];
 		}
 	}
 	else {
 		vl->stat.bytes += vidframe_size(frame->fmt, &frame->size);
 		(void)display(vl, frame, timestamp);
+		bench_mark(vl, STAGE_DISP, &t);
 	}
-
- out:
-	mem_deref(f2);
 }
 
 
@@ -441,12 +668,25 @@ static int print_stats(struct re_printf *pf, const struct video_loop *vl)
 
 	/* Video conversion */
 	if (vl->need_conv) {
+		double avg = .0;
+
+		if (vl->stats.conv_frames)
+			avg = (double)vl->stats.conv_usec /
+				vl->stats.conv_frames;
+
 		err |= re_hprintf(pf,
 				  "* Vidconv\n"
 				  "  pixformat   %s\n"
+				  "  path        %s\n"
+				  "  frames      %llu (allocs %llu)\n"
+				  "  time        %.1f usec (max %llu usec)\n"
 				  "\n"
 				  ,
-				  vidfmt_name(cfg->enc_fmt));
+				  vidfmt_name(cfg->enc_fmt),
+				  vl->conv_path,
+				  vl->stats.conv_frames,
+				  vl->stats.conv_allocs,
+				  avg, vl->stats.conv_max);
 	}
 
 	/* Filters */
@@ -479,12 +719,14 @@ static int print_stats(struct re_printf *pf, const struct video_loop *vl)
 				  "  module      %s\n"
 				  "  bitrate     %u bit/s (avg %.1f bit/s)\n"
 				  "  packets     %llu     (avg %.1f pkt/s)\n"
+				  "  pkt-allocs  %llu\n"
 				  "  duration    %.3f sec\n"
 				  "\n"
 				  ,
 				  vl->vc_enc->name,
 				  cfg->bitrate, avg_bitrate,
 				  vl->stats.enc_packets, avg_pktrate,
+				  vl->stats.pkt_allocs,
 				  dur);
 	}
 
@@ -493,29 +735,40 @@ static int print_stats(struct re_printf *pf, const struct video_loop *vl)
 		err |= re_hprintf(pf,
 				  "* Decoder\n"
 				  "  module      %s\n"
+				  "  frames      %llu\n"
 				  "  key-frames  %zu\n"
 				  "\n"
 				  ,
 				  vl->vc_dec->name,
+				  vl->stats.dec_frames,
 				  vl->stat.n_keyframe);
 	}
 
 	/* Display */
 	if (vl->vidisp) {
 		const struct vidisp *vd = vl->vd;
+		double delay = .0;
+
+		if (vl->stats.disp_frames)
+			delay = (double)vl->stats.delay_sum /
+				vl->stats.disp_frames / 1000.0;
 
 		err |= re_hprintf(pf,
 				  "* Display\n"
 				  "  module      %s\n"
 				  "  resolution  %u x %u\n"
 				  "  pixformat   %s\n"
-				  "  frames      %llu\n"
+				  "  frames      %llu (dropped %llu)\n"
+				  "  delay       %.2f ms (max %.2f ms)"
+				  " from frame handler\n"
 				  "\n"
 				  ,
 				  vd->name,
 				  vl->disp_size.w, vl->disp_size.h,
 				  vidfmt_name(vl->disp_fmt),
-				  vl->stats.disp_frames);
+				  vl->stats.disp_frames,
+				  vl->stats.disp_dropped,
+				  delay, vl->stats.delay_max / 1000.0);
 	}
 
 	return err;
@@ -533,17 +786,17 @@ static void vidloop_destructor(void *arg)
 	mem_deref(vl->vsrc);
 	mem_deref(vl->enc);
 	mem_deref(vl->dec);
+	mem_deref(vl->pkt_mb);
+	mem_deref(vl->conv_frame);
 	tmr_cancel(&vl->tmr_update_src);
 
-	mtx_lock(vl->frame_mutex);
+	mem_deref(vl->mq_display);
 	mem_deref(vl->vidisp);
-	mem_deref(vl->frame);
-	tmr_cancel(&vl->tmr_display);
-	mtx_unlock(vl->frame_mutex);
+	for (size_t i = 0; i < DISP_BUFS; i++)
+		mem_deref(vl->dispv[i].frame);
 
 	list_flush(&vl->filtencl);
 	list_flush(&vl->filtdecl);
-	mem_deref(vl->frame_mutex);
 }
 
 
@@ -714,7 +967,7 @@ static void update_vidsrc(void *arg)
 }
 
 
-static int video_loop_alloc(struct video_loop **vlp)
+static int video_loop_alloc(struct video_loop **vlp, bool headless)
 {
 	struct vidisp_prm disp_prm;
 	struct video_loop *vl;
@@ -732,19 +985,20 @@ static int video_loop_alloc(struct video_loop **vlp)
 
 	vl->cfg = cfg->video;
 	tmr_init(&vl->tmr_bw);
-	tmr_init(&vl->tmr_display);
 	tmr_init(&vl->tmr_update_src);
 
 	vl->src_fmt = -1;
 	vl->disp_fmt = -1;
 
-	err = mutex_alloc(&vl->frame_mutex);
+	vl->disp_back  = 0;
+	re_atomic_rlx_set(&vl->disp_mid, 1);
+	vl->disp_front = 2;
+
+	/* the producer wakes up the display on the main thread */
+	err = mqueue_alloc(&vl->mq_display, display_handler, vl);
 	if (err)
 		goto out;
 
-	vl->new_frame = false;
-	vl->frame = NULL;
-
 	/* Video filters */
 	for (le = list_head(baresip_vidfiltl()); le; le = le->next) {
 		struct vidfilt *vf = le->data;
@@ -770,6 +1024,10 @@ static int video_loop_alloc(struct video_loop **vlp)
 		}
 	}
 
+	/* the benchmark has a null display and no status output */
+	if (headless)
+		goto out;
+
 	info("vidloop: open video display (%s.%s)\n",
 	     vl->cfg.disp_mod, vl->cfg.disp_dev);
 
@@ -786,10 +1044,6 @@ static int video_loop_alloc(struct video_loop **vlp)
 	vl->vd = vidisp_find(baresip_vidispl(), vl->cfg.disp_mod);
 
 	tmr_start(&vl->tmr_bw, 1000, timeout_bw, vl);
-
-	/* NOTE: usually (e.g. SDL2),
-			 video frame must be rendered from main thread */
-	tmr_start(&vl->tmr_display, 10, display_handler, vl);
 	tmr_start(&vl->tmr_update_src, 10, update_vidsrc, vl);
 
  out:
@@ -824,7 +1078,7 @@ static int vidloop_start(struct re_printf *pf, void *arg)
 			 cfg->video.src_mod, cfg->video.src_dev,
 			 size.w, size.h);
 
-	err = video_loop_alloc(&gvl);
+	err = video_loop_alloc(&gvl, false);
 	if (err) {
 		warning("vidloop: alloc: %m\n", err);
 		return err;
@@ -868,9 +1122,299 @@ static int vidloop_stop(struct re_printf *pf, void *arg)
 }
 
 
+static void bench_destructor(void *arg)
+{
+	struct bench *b = arg;
+
+	for (size_t i = 0; i < STAGE_N; i++)
+		mem_deref(b->usecv[i]);
+}
+
+
+static int bench_alloc(struct bench **bp, uint32_t framec)
+{
+	struct bench *b;
+
+	b = mem_zalloc(sizeof(*b), bench_destructor);
+	if (!b)
+		return ENOMEM;
+
+	b->framec = framec;
+
+	for (size_t i = 0; i < STAGE_N; i++) {
+		b->usecv[i] = mem_zalloc(framec * sizeof(uint32_t), NULL);
+		if (!b->usecv[i]) {
+			mem_deref(b);
+			return ENOMEM;
+		}
+	}
+
+	*bp = b;
+	return 0;
+}
+
+
+static void bench_frame_done(struct bench *b, uint64_t usec)
+{
+	if (b->n >= b->framec)
+		return;
+
+	for (size_t i = 0; i < STAGE_N; i++) {
+		b->usecv[i][b->n] = (uint32_t)b->cur[i];
+		b->cur[i] = 0;
+	}
+
+	b->usec += usec;
+	++b->n;
+}
+
+
+static uint8_t bench_luma(unsigned x, unsigned y, uint32_t i, uint32_t *rnd)
+{
+	*rnd ^= *rnd << 13;
+	*rnd ^= *rnd >> 17;
+	*rnd ^= *rnd << 5;
+
+	return (uint8_t)(((x + 4*i) ^ y) + (*rnd & 0xf));
+}
+
+
+/*
+ * Synthetic source: a texture that moves by four pixels per frame, with
+ * some noise, so that the encoder has real work to do. The chroma of the
+ * pixel (2x, 2y) is (64 + (x + 2i) % 128, 64 + y % 128).
+ */
+static void bench_pattern(struct vidframe *f, uint32_t i, uint32_t *rnd)
+{
+	const unsigned w = f->size.w, h = f->size.h;
+
+	if (f->fmt == VID_FMT_YUYV422) {
+
+		for (unsigned y = 0; y < h; y++) {
+			uint8_t *p = f->data[0] + (size_t)y * f->linesize[0];
+
+			for (unsigned x = 0; x < w / 2; x++) {
+				p[4*x]     = bench_luma(2*x, y, i, rnd);
+				p[4*x + 1] = (uint8_t)(64 + (x + 2*i) % 128);
+				p[4*x + 2] = bench_luma(2*x + 1, y, i, rnd);
+				p[4*x + 3] = (uint8_t)(64 + (y/2) % 128);
+			}
+		}
+
+		return;
+	}
+
+	for (unsigned y = 0; y < h; y++) {
+		uint8_t *p = f->data[0] + (size_t)y * f->linesize[0];
+
+		for (unsigned x = 0; x < w; x++)
+			p[x] = bench_luma(x, y, i, rnd);
+	}
+
+	for (unsigned y = 0; y < h / 2; y++) {
+		uint8_t *u = f->data[1] + (size_t)y * f->linesize[1];
+		uint8_t *v = f->data[2] + (size_t)y * f->linesize[2];
+
+		for (unsigned x = 0; x < w / 2; x++) {
+			const uint8_t cu = (uint8_t)(64 + (x + 2*i) % 128);
+			const uint8_t cv = (uint8_t)(64 + y % 128);
+
+			if (f->fmt == VID_FMT_NV12) {
+				u[2*x]     = cu;
+				u[2*x + 1] = cv;
+			}
+			else {
+				u[x] = cu;
+				v[x] = cv;
+			}
+		}
+	}
+}
+
+
+static int usec_cmp(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+
+static uint32_t percentile(const uint32_t *v, size_t n, unsigned p)
+{
+	if (!n)
+		return 0;
+
+	return v[(n - 1) * p / 100];
+}
+
+
+static int bench_print(struct re_printf *pf, const struct video_loop *vl)
+{
+	const struct bench *b = vl->bench;
+	double fps = .0, bits;
+	int err = 0;
+
+	if (b->usec)
+		fps = b->n * 1000000.0 / b->usec;
+
+	if (vl->vc_enc && b->n)
+		bits = 8.0 * vl->stats.enc_bytes / b->n;
+	else
+		bits = 8.0 * vidframe_size(vl->cfg.enc_fmt, &vl->src_size);
+
+	err |= re_hprintf(pf,
+			  "~~~~~ Videoloop benchmark: ~~~~~\n"
+			  "  codec       %s\n"
+			  "  resolution  %u x %u\n"
+			  "  pixformat   %s -> %s\n"
+			  "  frames      %u (decoded %llu, key-frames %zu)\n"
+			  "  throughput  %.1f fps (%.3f sec)\n"
+			  "  bits/frame  %.1f\n"
+			  "\n"
+			  "  stage          p50      p95      p99      max"
+			  "  [usec]\n"
+			  ,
+			  vl->vc_enc ? vl->vc_enc->name : "none",
+			  vl->src_size.w, vl->src_size.h,
+			  vidfmt_name(vl->src_fmt),
+			  vidfmt_name(vl->cfg.enc_fmt),
+			  b->n, vl->stats.dec_frames, vl->stat.n_keyframe,
+			  fps, b->usec * .000001,
+			  bits);
+
+	for (size_t i = 0; i < STAGE_N; i++) {
+		uint32_t *v = b->usecv[i];
+
+		qsort(v, b->n, sizeof(*v), usec_cmp);
+
+		err |= re_hprintf(pf, "  %-10s %8u %8u %8u %8u\n",
+				  stage_names[i],
+				  percentile(v, b->n, 50),
+				  percentile(v, b->n, 95),
+				  percentile(v, b->n, 99),
+				  percentile(v, b->n, 100));
+	}
+
+	return err;
+}
+
+
+/* the pixel formats of the synthetic source */
+static enum vidfmt bench_fmt(const struct pl *pl)
+{
+	static const enum vidfmt fmtv[] = {
+		VID_FMT_YUV420P, VID_FMT_NV12, VID_FMT_YUYV422
+	};
+
+	if (!pl_isset(pl))
+		return VID_FMT_YUV420P;
+
+	for (size_t i = 0; i < RE_ARRAY_SIZE(fmtv); i++) {
+		if (!pl_strcasecmp(pl, vidfmt_name(fmtv[i])))
+			return fmtv[i];
+	}
+
+	return VID_FMT_N;
+}
+
+
+/**
+ * Run the video loop headless and as fast as possible, from a synthetic
+ * source to a null display, and print the time spent in every stage
+ *
+ * Usage: vidloop_bench [codec] [frames] [pixfmt]
+ */
+static int vidloop_bench(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl pl_codec = PL_INIT, pl_n = PL_INIT, pl_fmt = PL_INIT;
+	struct config *cfg = conf_config();
+	struct video_loop *vl = NULL;
+	struct vidframe *src = NULL;
+	uint32_t framec = BENCH_FRAMES;
+	uint32_t rnd = 0x12345678;
+	char codec[64];
+	enum vidfmt fmt;
+	struct vidsz size;
+	int err;
+
+	if (gvl)
+		return re_hprintf(pf, "video-loop already running.\n");
+
+	if (str_isset(carg->prm)) {
+		(void)re_regex(carg->prm, str_len(carg->prm),
+			       "[^ ]*[ ]*[0-9]*[ ]*[^ ]*",
+			       &pl_codec, NULL, &pl_n, NULL, &pl_fmt);
+	}
+
+	if (pl_isset(&pl_n))
+		framec = pl_u32(&pl_n);
+
+	fmt = bench_fmt(&pl_fmt);
+
+	if (!framec || framec > BENCH_MAX_FRAMES || fmt == VID_FMT_N) {
+		return re_hprintf(pf, "usage: vidloop_bench [codec]"
+				  " [frames 1-%u] [yuv420p|nv12|yuyv422]\n",
+				  BENCH_MAX_FRAMES);
+	}
+
+	/* the fast conversion paths need even dimensions */
+	size.w = cfg->video.width & ~1u;
+	size.h = cfg->video.height & ~1u;
+
+	err = video_loop_alloc(&vl, true);
+	if (err)
+		return err;
+
+	if (pl_isset(&pl_codec)) {
+
+		pl_strcpy(&pl_codec, codec, sizeof(codec));
+
+		err  = enable_encoder(vl, codec);
+		err |= enable_decoder(vl, codec);
+		if (err)
+			goto out;
+	}
+
+	err  = bench_alloc(&vl->bench, framec);
+	err |= vidframe_alloc(&src, fmt, &size);
+	if (err)
+		goto out;
+
+	(void)re_hprintf(pf, "vidloop: benchmark of %u frames, %u x %u\n",
+			 framec, size.w, size.h);
+
+	for (uint32_t i = 0; i < framec; i++) {
+		const uint64_t ts = (uint64_t)(i * (double)VIDEO_TIMEBASE /
+					       vl->cfg.fps);
+		uint64_t t;
+
+		/* the source is not part of the measured pipeline */
+		bench_pattern(src, i, &rnd);
+
+		t = tmr_jiffies_usec();
+		vidsrc_frame_handler(src, ts, vl);
+		bench_frame_done(vl->bench, tmr_jiffies_usec() - t);
+	}
+
+	err = re_hprintf(pf, "%H\n", bench_print, vl);
+
+ out:
+	mem_deref(src);
+	if (vl)
+		mem_deref(vl->bench);
+	mem_deref(vl);
+
+	return err;
+}
+
+
 static const struct cmd cmdv[] = {
 	{"vidloop",     0, CMD_PRM, "Start video-loop <codec>", vidloop_start},
 	{"vidloop_stop",0, 0,       "Stop video-loop",          vidloop_stop },
+	{"vidloop_bench",0,CMD_PRM, "Benchmark video-loop",     vidloop_bench},
 };
 
 